@@ -1,13 +1,23 @@
 #define F_CPU 16000000UL
 #define MAX_TIMERS 5
 #define C_MAX 7
+#define BAUDRATE 9600
+#define BAUD_CONST ((F_CPU + 8UL * BAUDRATE) / (16UL * BAUDRATE) - 1) // Rounded UBRR, normal speed
+#define REPORT_US 10000000 // Sleep statistics over the UART every 10 s
 
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <util/atomic.h>
 
 volatile uint8_t led_counter = 0;
 volatile uint32_t virtual_timer_ticks = 0;
 
+// Time spent asleep and awake, only used by the main loop
+uint64_t sleep_us = 0;  // In idle sleep, including the interrupt that ends it
+uint64_t awake_us = 0;  // Running the main loop
+uint32_t wakeups = 0;   // Number of sleeps
+
 // Structure to represent each virtual timer
 typedef struct {
 	uint32_t timeout;           // Timer timeout in ticks
@@ -19,6 +29,28 @@ typedef struct {
 // Array of virtual timers
 VirtualTimer timers[MAX_TIMERS];
 
+// Read the 32 bit tick counter without the ISR changing it in between
+uint32_t getTicks() {
+	uint32_t ticks;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		ticks = virtual_timer_ticks;
+	}
+	return ticks;
+}
+
+// Microseconds since start with 4 us resolution (Timer1 counts within the tick), wraps after ~71 minutes
+uint32_t micros() {
+	uint32_t ticks;
+	uint8_t counts;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		ticks = virtual_timer_ticks;
+		counts = TCNT1;
+		// TCNT1 has already restarted if the compare match is not handled yet
+		if ((TIFR1 & (1 << OCF1A)) && counts < 63) counts += 64;
+	}
+	return (ticks << 8) + ((uint32_t)counts << 2);
+}
+
 // Function to declare a timer
 void declareTimer(uint8_t timer_index, uint32_t timeout_us, void (*callback)(void)) {
 	if (timer_index < MAX_TIMERS) {
@@ -30,7 +62,7 @@ void declareTimer(uint8_t timer_index, uint32_t timeout_us, void (*callback)(voi
 
 // Function to start or restart a timer
 void startTimer(uint8_t timer_index) {
-	timers[timer_index].last_tick = virtual_timer_ticks; // Set last tick to current time
+	timers[timer_index].last_tick = getTicks(); // Set last tick to current time
 	timers[timer_index].active = 1;  // Set timer as active
 }
 
@@ -76,6 +108,49 @@ void event_50ms() {
 
 
 
+// Report buffer, sent by USART_UDRE_vect while the main loop keeps running
+char report[96]; // Longest report with 10 digit numbers is 85 chars
+volatile uint8_t report_pos = 0;
+uint8_t report_len = 0;
+
+// Append 'val' in decimal to the report
+void reportNumber(uint32_t val) {
+	char digits[10];
+	uint8_t n = 0;
+	do {
+		digits[n++] = '0' + val % 10;
+		val /= 10;
+	} while (val);
+	while (n) report[report_len++] = digits[--n];
+}
+
+void reportString(const char *str) {
+	while (*str) report[report_len++] = *str++;
+}
+
+// Report event: time asleep and awake in ms and the utilisation in percent
+void event_report() {
+	if (report_pos != report_len) return; // Previous report still being sent
+	
+	uint64_t total_us = sleep_us + awake_us;
+	report_len = 0;
+	reportString("Schlaf: ");
+	reportNumber(sleep_us / 1000);
+	reportString(" ms, Wach: ");
+	reportNumber(awake_us / 1000);
+	reportString(" ms, Auslastung: ");
+	reportNumber(total_us ? awake_us * 100 / total_us : 0);
+	reportString(" %, Aufwachen: ");
+	reportNumber(wakeups);
+	reportString("\r\n");
+	
+	report_pos = 0;
+	UCSR0B |= (1 << UDRIE0); // UDRE interrupt sends the report
+}
+
+
+
+
 
 
 
@@ -86,6 +161,15 @@ ISR(TIMER1_COMPA_vect) {
 	virtual_timer_ticks++; 
 }
 
+// Data register empty, send the next char of the report
+ISR(USART_UDRE_vect) {
+	if (report_pos < report_len) {
+		UDR0 = report[report_pos++];
+	} else {
+		UCSR0B &= ~(1 << UDRIE0); // Report sent, the interrupt would fire forever otherwise
+	}
+}
+
 
 
 
@@ -128,29 +212,52 @@ void timer_interrupt_init() {
 	TCCR1B |= (1 << CS10) | (1 << CS11);
 }
 
+// UART only sends the sleep report: 8 data bits, 1 stop bit, no parity
+void uart_init() {
+	UBRR0H = (BAUD_CONST >> 8);
+	UBRR0L = BAUD_CONST;
+	UCSR0B = (1 << TXEN0);
+	UCSR0C = (1 << UCSZ01) | (1 << UCSZ00);
+}
+
 int main() {
 	port_io_init();
 	timer_interrupt_init();
+	uart_init();
 	
+	set_sleep_mode(SLEEP_MODE_IDLE); // Timer1 keeps running in idle sleep
 	sei(); // Enable Interrupts
 
 	declareTimer(0, 1000000, event_1s);  // 1-second timer
 	declareTimer(1, 50000, event_50ms);  // 50ms timer
+	declareTimer(2, REPORT_US, event_report); // Sleep statistics
 	startTimer(1);  
+	startTimer(2);
+	
+	uint32_t wake = micros(); // End of the last sleep
 
 	while (1) {
 
 		// Check each virtual timer
+		uint32_t now = getTicks(); // One consistent snapshot per pass
 		for (uint8_t i = 0; i < MAX_TIMERS; i++) {
-			if (timers[i].active && virtual_timer_ticks - timers[i].last_tick >= timers[i].timeout) {
+			if (timers[i].active && now - timers[i].last_tick >= timers[i].timeout) {
 				// Timer expired -> call callback
 				if (timers[i].callback) {
 					timers[i].callback();
 				}
 			
-				timers[i].last_tick = virtual_timer_ticks;
+				timers[i].last_tick = now;
 			}
 		}
+		
+		// Nothing can change before the next timer tick, sleep until its interrupt
+		uint32_t sleep = micros();
+		awake_us += sleep - wake;
+		sleep_mode();
+		wake = micros();
+		sleep_us += wake - sleep;
+		wakeups++;
 	
 	}
 }
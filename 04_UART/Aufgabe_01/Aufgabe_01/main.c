@@ -8,7 +8,23 @@
 #define F_CPU 16000000UL
 
 #define BAUDRATE 9600
-#define BAUD_CONST (((F_CPU/(BAUDRATE*16UL)))-1)
+#define BAUD_MAX_ERROR_PERMILLE 25 // Max. deviation of the real baud rate (2.5 %, 115200 with U2X has 2.1 %)
+// Rounded UBRR for normal (16 samples per bit) and double speed mode (U2X0, 8 samples per bit)
+#define BAUD_UBRR_16 ((F_CPU + 8UL * BAUDRATE) / (16UL * BAUDRATE) - 1)
+#define BAUD_UBRR_8  ((F_CPU + 4UL * BAUDRATE) / (8UL * BAUDRATE) - 1)
+#define BAUD_ERROR_16 (BAUD_ERROR(16UL * BAUDRATE * (BAUD_UBRR_16 + 1)))
+#define BAUD_ERROR_8  (BAUD_ERROR(8UL * BAUDRATE * (BAUD_UBRR_8 + 1)))
+#define BAUD_ERROR(clk) (((clk) > F_CPU ? (clk) - F_CPU : F_CPU - (clk)) * 1000 / (clk)) // Permille
+// Double speed only if it is more accurate, normal mode samples more often and tolerates more noise
+#define BAUD_U2X (BAUD_ERROR_8 < BAUD_ERROR_16)
+#define BAUD_CONST (BAUD_U2X ? BAUD_UBRR_8 : BAUD_UBRR_16)
+#define BAUD_ERROR_PERMILLE (BAUD_U2X ? BAUD_ERROR_8 : BAUD_ERROR_16)
+#if BAUD_ERROR_PERMILLE > BAUD_MAX_ERROR_PERMILLE
+#error "BAUDRATE cannot be reached with this F_CPU"
+#endif
+#if BAUD_CONST > 4095
+#error "BAUDRATE too low for this F_CPU"
+#endif
 
 #include <avr/io.h>
 #include <util/delay.h>
@@ -17,6 +33,11 @@
 void USART_Init(){
 	UBRR0H = (BAUD_CONST >> 8);
 	UBRR0L = BAUD_CONST;
+#if BAUD_U2X
+	UCSR0A |= (1 << U2X0); // Double speed
+#else
+	UCSR0A &= ~(1 << U2X0);
+#endif
 	UCSR0B |= (1<<RXEN0)|(1<<TXEN0);
 }
 
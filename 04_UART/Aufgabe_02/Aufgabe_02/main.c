@@ -1,89 +1,240 @@
 #define F_CPU 16000000UL
 
 #define BAUDRATE 9600
-#define BAUD_CONST (((F_CPU/(BAUDRATE*16UL)))-1)
+#define BAUD_MAX_ERROR_PERMILLE 25 // Max. deviation of the real baud rate (2.5 %, 115200 with U2X has 2.1 %)
+// Rounded UBRR for normal (16 samples per bit) and double speed mode (U2X0, 8 samples per bit)
+#define BAUD_UBRR_16 ((F_CPU + 8UL * BAUDRATE) / (16UL * BAUDRATE) - 1)
+#define BAUD_UBRR_8  ((F_CPU + 4UL * BAUDRATE) / (8UL * BAUDRATE) - 1)
+#define BAUD_ERROR_16 (BAUD_ERROR(16UL * BAUDRATE * (BAUD_UBRR_16 + 1)))
+#define BAUD_ERROR_8  (BAUD_ERROR(8UL * BAUDRATE * (BAUD_UBRR_8 + 1)))
+#define BAUD_ERROR(clk) (((clk) > F_CPU ? (clk) - F_CPU : F_CPU - (clk)) * 1000 / (clk)) // Permille
+// Double speed only if it is more accurate, normal mode samples more often and tolerates more noise
+#define BAUD_U2X (BAUD_ERROR_8 < BAUD_ERROR_16)
+#define BAUD_CONST (BAUD_U2X ? BAUD_UBRR_8 : BAUD_UBRR_16)
+#define BAUD_ERROR_PERMILLE (BAUD_U2X ? BAUD_ERROR_8 : BAUD_ERROR_16)
+#if BAUD_ERROR_PERMILLE > BAUD_MAX_ERROR_PERMILLE
+#error "BAUDRATE cannot be reached with this F_CPU"
+#endif
+#if BAUD_CONST > 4095
+#error "BAUDRATE too low for this F_CPU"
+#endif
 
 #include <avr/io.h>
-#include <util/delay.h>
 #include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <util/atomic.h>
+#include "../../../Common/ringbuffer.h"
 
 
 // Ring buffer parameters
-#define RINGBUFFER_SIZE 32
+#define RINGBUFFER_SIZE 32 // Receive buffer (power of two, max. 128)
 #define RINGBUFFER_HIGH_LIMIT 20
 #define RINGBUFFER_LOW_LIMIT 4
+#define TX_BUFFER_SIZE 64 // Transmit buffer, drained by the UDRE interrupt (power of two, max. 128)
+
+// Line mode: 1 = the RX interrupt echoes and edits the input and delivers whole lines,
+// 0 = single chars through the ring buffer
+#define UART_LINE_MODE 1
+#define LINE_LENGTH 64 // Max. chars per line (without terminator)
 
 #define XON  0x11
 #define XOFF 0x13
 
 uint8_t flowcontrol = 1; // 0 = XOFF, 1 = XON
 
-typedef struct {
-	uint8_t buffer[RINGBUFFER_SIZE];
-	uint8_t head; // Pointer to the next write position in the buffer
-	uint8_t tail; // Pointer to the next read position in the buffer
-	uint8_t size; // Tracks the number of elements currently in the buffer
-} RingBuffer32;
+// Time base for the sleep statistics: Timer1 runs freely with prescaler 64 (1 count = 4 us)
+volatile uint32_t timer1_overflows = 0; // Upper bits of the Timer1 count
+uint64_t sleep_counts = 0; // Timer1 counts spent asleep, including the interrupt that ends the sleep
+uint32_t wakeups = 0;      // Number of sleeps
+
+RINGBUFFER(rx_buffer, RINGBUFFER_SIZE); // Filled by USART_RX_vect in char mode
+RINGBUFFER(tx_buffer, TX_BUFFER_SIZE);  // Drained by USART_UDRE_vect
+
+
+
+
+
 
-volatile RingBuffer32 rb;
 
-// Initialize an empty ring buffer
-void ringBufferInit() {
-	rb.head = rb.tail = 0; 
-	rb.size = 0;    
+volatile uint8_t tx_priority = 0; // XON/XOFF waiting to be sent before the transmit buffer, 0 = none
+
+// Queue up to 'len' bytes without waiting, returns the number of bytes queued (safe inside an interrupt)
+uint8_t USART_write(const uint8_t *data, uint8_t len) {
+	len = ringBufferWriteN(&tx_buffer, data, len);
+	if (len > 0) UCSR0B |= (1 << UDRIE0); // UDRE interrupt sends them
+	return len;
+}
+
+// Send XON/XOFF before everything in the transmit buffer, never waits
+void USART_TransmitPriority(unsigned char data) {
+	tx_priority = data;
+	UCSR0B |= (1 << UDRIE0);
 }
 
-// Write data to the buffer
-void ringBufferWrite(uint8_t data) {
-	rb.buffer[rb.head] = data; // Write the data to the buffer at the head position
-	rb.head = (rb.head + 1) % RINGBUFFER_SIZE; // Move the head pointer to the next position, wrapping around if needed
-	rb.size++; // Increment the size of the buffer
+// Send single char, waits while the transmit buffer is full
+// The RX interrupt echoes into the same buffer, so the write must not be interrupted by it
+void USART_Transmit(unsigned char data){
+	uint8_t queued;
+	do {
+		uint8_t sreg = SREG;
+		cli();
+		queued = USART_write(&data, 1);
+		SREG = sreg;
+	} while (!queued);
 }
 
-// Read data from the buffer
-uint8_t ringBufferRead() {
-	uint8_t data = 0;
-	if (rb.size > 0) { // Check if the buffer is not empty
-		data = rb.buffer[rb.tail]; // Read the data from the buffer at the tail position
-		rb.tail = (rb.tail + 1) % RINGBUFFER_SIZE; // Move the tail pointer to the next position, wrapping around if needed
-		rb.size--; // Decrement the size of the buffer
+// Timer1 counts (4 us) since start
+uint64_t timer1Counts() {
+	uint16_t counts;
+	uint32_t overflows;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		counts = TCNT1;
+		overflows = timer1_overflows;
+		if ((TIFR1 & (1 << TOV1)) && counts < 0x8000) overflows++; // Overflow not handled yet
 	}
-	return data;
+	return ((uint64_t)overflows << 16) | counts;
 }
 
+// Sleep until the next interrupt and count the time asleep
+// Called with interrupts disabled, returns with interrupts disabled
+void sleepOnce() {
+	uint64_t start = timer1Counts();
+	sleep_enable();
+	sei(); // sei() always executes the next instruction, so an interrupt right before sleep_cpu() still wakes us up
+	sleep_cpu();
+	sleep_disable();
+	cli();
+	sleep_counts += timer1Counts() - start;
+	wakeups++;
+}
 
+// Sleep until 'cond' is true
+// The check runs with interrupts disabled, so nothing can change it between the check and the sleep
+#define SLEEP_UNTIL(cond) do { \
+	set_sleep_mode(SLEEP_MODE_IDLE); \
+	cli(); \
+	while (!(cond)) sleepOnce(); \
+	sei(); \
+} while (0)
 
 
+#if UART_LINE_MODE
 
+// Two line buffers: the RX interrupt edits one while the application reads the other
+volatile char line_buffer[2][LINE_LENGTH + 1];
+volatile uint8_t line_edit = 0;      // Buffer the interrupt is writing to
+volatile uint8_t line_edit_len = 0;  // Chars in the edit buffer
+volatile uint8_t line_ready = 0;     // 1 = the other buffer holds a finished line
+volatile uint8_t line_ready_len = 0; // Length of the finished line
+volatile uint8_t line_last = 0;      // Last received char, to treat CR LF as one terminator
+volatile uint16_t line_dropped = 0;  // Lines lost because the application still held the previous one
 
+const uint8_t echo_backspace[] = { '\b', ' ', '\b' };
+const uint8_t echo_newline[] = { '\r', '\n' };
 
-void USART_Transmit(unsigned char data){
-	while(!(UCSR0A & (1<<UDRE0))) ;
-	UDR0 = data;
+// Handles one received char in line mode, called by USART_RX_vect
+void lineInput(uint8_t data) {
+	uint8_t last = line_last;
+	line_last = data;
+	
+	if (data == '\r' || data == '\n') {
+		if (data == '\n' && last == '\r') return; // Second half of CR LF
+		USART_write(echo_newline, sizeof(echo_newline));
+		
+		if (line_ready) { // Application is still busy with the previous line
+			line_dropped++;
+		} else {
+			line_buffer[line_edit][line_edit_len] = '\0';
+			line_ready_len = line_edit_len;
+			line_ready = 1;
+			line_edit ^= 1; // Continue in the other buffer
+		}
+		line_edit_len = 0;
+	} else if (data == '\b' || data == 0x7F) { // Backspace or Delete
+		if (line_edit_len > 0) {
+			line_edit_len--;
+			USART_write(echo_backspace, sizeof(echo_backspace));
+		}
+	} else if (data >= ' ') {
+		if (line_edit_len < LINE_LENGTH) {
+			line_buffer[line_edit][line_edit_len++] = data;
+			USART_write(&data, 1); // Echo
+		} else {
+			uint8_t bell = '\a';
+			USART_write(&bell, 1); // Line full
+		}
+	}
+	
+	// Stop the sender while a finished line waits and the next one is filling up
+	if (line_ready && line_edit_len >= RINGBUFFER_HIGH_LIMIT && flowcontrol == 1) {
+		USART_TransmitPriority(XOFF);
+		flowcontrol = 0;
+	}
+}
+
+// Wait for a complete line, returns its length and a pointer to it in 'line' (zero terminated)
+// The line stays valid until USART_releaseLine()
+uint8_t USART_readLine(const char **line) {
+	SLEEP_UNTIL(line_ready);
+	*line = (const char *)line_buffer[line_edit ^ 1];
+	return line_ready_len;
 }
 
+// Hand the line buffer back to the interrupt
+void USART_releaseLine() {
+	line_ready = 0;
+	if (flowcontrol == 0) {
+		USART_TransmitPriority(XON);
+		flowcontrol = 1;
+	}
+}
+
+#else
 
 unsigned char USART_Receive(){
-	while(rb.size == 0);
-	uint8_t data = ringBufferRead();
-	if(rb.size <= RINGBUFFER_LOW_LIMIT && flowcontrol == 0) {
-		USART_Transmit(XON);
+	// Sleep until the RX interrupt has put something into the buffer
+	SLEEP_UNTIL(ringBufferCount(&rx_buffer) > 0);
+	uint8_t data = ringBufferRead(&rx_buffer);
+	if(ringBufferCount(&rx_buffer) <= RINGBUFFER_LOW_LIMIT && flowcontrol == 0) {
+		USART_TransmitPriority(XON);
 		flowcontrol = 1;
 	}
 	return data;
 }
 
+#endif
+
 
 
 
+ISR(TIMER1_OVF_vect) {
+	timer1_overflows++;
+}
+
 ISR(USART_RX_vect) {
 	uint8_t data = UDR0; // The received character is ready here.
-	ringBufferWrite(data);
+#if UART_LINE_MODE
+	lineInput(data);
+#else
+	ringBufferWrite(&rx_buffer, data); // Dropped if the buffer is full
 	
-	if(rb.size >= RINGBUFFER_HIGH_LIMIT && flowcontrol == 1) {
-		USART_Transmit(XOFF);
+	if(ringBufferCount(&rx_buffer) >= RINGBUFFER_HIGH_LIMIT && flowcontrol == 1) {
+		USART_TransmitPriority(XOFF);
 		flowcontrol = 0;
 	}
+#endif
+}
+
+// Data register empty, send the next byte (XON/XOFF first)
+ISR(USART_UDRE_vect) {
+	if (tx_priority) {
+		UDR0 = tx_priority;
+		tx_priority = 0;
+	} else if (ringBufferCount(&tx_buffer) > 0) {
+		UDR0 = ringBufferRead(&tx_buffer);
+	} else {
+		UCSR0B &= ~(1 << UDRIE0); // Nothing left, the interrupt would fire forever otherwise
+	}
 }
 
 
@@ -92,42 +243,105 @@ ISR(USART_RX_vect) {
 void USART_Init() {
 	UBRR0H = (BAUD_CONST >> 8);
 	UBRR0L = BAUD_CONST;
+#if BAUD_U2X
+	UCSR0A |= (1 << U2X0); // Double speed
+#else
+	UCSR0A &= ~(1 << U2X0);
+#endif
 	UCSR0B |= (1 << RXEN0) | (1 << TXEN0) | (1 << RXCIE0);
 	UCSR0C |= (1 << UCSZ01) | (1 << UCSZ00); 
 	sei(); // Enable global interrupts
 }
 
+void USART_puts(const char *str) {
+	while (*str) USART_Transmit(*str++);
+}
+
+// Send unsigned number as decimal string
+void USART_putNumber(uint32_t val) {
+	char digits[10];
+	uint8_t n = 0;
+	do {
+		digits[n++] = '0' + val % 10;
+		val /= 10;
+	} while (val);
+	while (n) USART_Transmit(digits[--n]);
+}
+
+// Free running Timer1, only used as time base for the sleep statistics
+void timer_init() {
+	TCCR1A = 0;
+	TCCR1B = (1 << CS11) | (1 << CS10); // Prescaler 64
+	TIMSK1 = (1 << TOIE1); // Overflow every 262 ms extends the count
+}
+
+// Time asleep and awake since start, sent when the name is "?"
+void reportSleep() {
+	uint64_t total;
+	uint64_t asleep;
+	uint32_t count;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		total = timer1Counts();
+		asleep = sleep_counts;
+		count = wakeups;
+	}
+	USART_puts("Laufzeit: ");
+	USART_putNumber(total * 4 / 1000);
+	USART_puts(" ms, Schlaf: ");
+	USART_putNumber(asleep * 4 / 1000);
+	USART_puts(" ms, Wach: ");
+	USART_putNumber((total - asleep) * 4 / 1000);
+	USART_puts(" ms, Aufwachen: ");
+	USART_putNumber(count);
+}
+
 int main(void){
-	char name[512];
-	int g = 0;
 	const char meldung[]="Hier ATmega. Wer da?";
 	
-	ringBufferInit();
+	ringBufferInit(&rx_buffer);
+	timer_init();
 	USART_Init();
-	USART_Transmit(XON);
+	USART_TransmitPriority(XON);
 	flowcontrol = 1;
 	
-	for(int f=0;meldung[f]!='\0';f++)
-		USART_Transmit(meldung[f]);
-		
+	USART_puts(meldung);
+	
+#if UART_LINE_MODE
 	while (1) {
-		name[g] = USART_Receive();
-		
-		_delay_ms(100);
+		const char *name;
+		uint8_t len = USART_readLine(&name); // Echo and editing already happened in the interrupt
+		if (len == 1 && name[0] == '?') {
+			reportSleep();
+		} else {
+			USART_puts("Hi ");
+			USART_puts(name);
+		}
+		USART_releaseLine();
+		USART_Transmit(0x0d);
+		USART_Transmit(0x0a);
+	}
+#else
+	char name[LINE_LENGTH];
+	uint8_t g = 0;
 	
-		if (name[g]!=0x0d){ // If not carriage return
-			USART_Transmit(name[g]);
-			g++;
+	while (1) {
+		uint8_t c = USART_Receive();
+		
+		if (c != 0x0d){ // If not carriage return
+			USART_Transmit(c);
+			if (g < LINE_LENGTH) name[g++] = c;
 			continue;
 		}
 		USART_Transmit(0x0d);
-		USART_Transmit('H');
-		USART_Transmit('i');
-		USART_Transmit(' ');
-		for(int f=0;f<g;f++)
-			USART_Transmit(name[f]);
+		if (g == 1 && name[0] == '?') {
+			reportSleep();
+		} else {
+			USART_puts("Hi ");
+			for(uint8_t f=0;f<g;f++)
+				USART_Transmit(name[f]);
+		}
 		g = 0;
 		USART_Transmit(0x0d);
-    }
+	}
+#endif
 }
-
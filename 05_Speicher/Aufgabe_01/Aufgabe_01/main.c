@@ -2,14 +2,31 @@
 
 // Timer defines
 #define MAX_TIMERS 2
+#define TIMER_EVENT_QUEUE_SIZE 8 // Expired timers waiting for dispatch (power of two)
 #define C_MAX 7
 
 // UART defines
 #define BAUDRATE 9600
-#define BAUD_CONST (((F_CPU/(BAUDRATE*16UL)))-1)
+#define BAUD_MAX_ERROR_PERMILLE 25 // Max. deviation of the real baud rate (2.5 %, 115200 with U2X has 2.1 %)
+// Rounded UBRR for normal (16 samples per bit) and double speed mode (U2X0, 8 samples per bit)
+#define BAUD_UBRR_16 ((F_CPU + 8UL * BAUDRATE) / (16UL * BAUDRATE) - 1)
+#define BAUD_UBRR_8  ((F_CPU + 4UL * BAUDRATE) / (8UL * BAUDRATE) - 1)
+#define BAUD_ERROR_16 (BAUD_ERROR(16UL * BAUDRATE * (BAUD_UBRR_16 + 1)))
+#define BAUD_ERROR_8  (BAUD_ERROR(8UL * BAUDRATE * (BAUD_UBRR_8 + 1)))
+#define BAUD_ERROR(clk) (((clk) > F_CPU ? (clk) - F_CPU : F_CPU - (clk)) * 1000 / (clk)) // Permille
+// Double speed only if it is more accurate, normal mode samples more often and tolerates more noise
+#define BAUD_U2X (BAUD_ERROR_8 < BAUD_ERROR_16)
+#define BAUD_CONST (BAUD_U2X ? BAUD_UBRR_8 : BAUD_UBRR_16)
+#define BAUD_ERROR_PERMILLE (BAUD_U2X ? BAUD_ERROR_8 : BAUD_ERROR_16)
+#if BAUD_ERROR_PERMILLE > BAUD_MAX_ERROR_PERMILLE
+#error "BAUDRATE cannot be reached with this F_CPU"
+#endif
+#if BAUD_CONST > 4095
+#error "BAUDRATE too low for this F_CPU"
+#endif
 
 // Ring buffer parameters
-#define RINGBUFFER_SIZE 32
+#define RINGBUFFER_SIZE 32 // Receive buffer (power of two, max. 128)
 #define RINGBUFFER_HIGH_LIMIT 20
 #define RINGBUFFER_LOW_LIMIT 4
 
@@ -23,6 +40,8 @@
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <avr/pgmspace.h>
+#include <util/atomic.h>
+#include "../../../Common/ringbuffer.h"
 
 
 // Global Variables for LEDs and Timer
@@ -45,6 +64,7 @@ const char menu_str[] PROGMEM =
 "b: Stoppuhr stoppen und Zeit ausgeben\r\n"
 "c: Startzeit einstellen\r\n"
 "d: Aktuell eingestellte Startzeit anzeigen\r\n"
+"t: Verspaetung der Timer anzeigen\r\n"
 "h: Dieses Menu anzeigen\r\n"
 "--------------------------\r\n";
 
@@ -56,6 +76,10 @@ const char set_time_msg[] PROGMEM = "\r\nGeben Sie die Startzeit (0-7) ein: ";
 const char show_time_msg[] PROGMEM = "\r\nAktuell eingestellte Startzeit: ";
 const char invalid_time_msg[] PROGMEM = "\r\nUngueltige Zeit! Bitte zwischen 0 und 7 eingeben.\r\n";
 const char unknown_cmd_msg[] PROGMEM = "\r\nUnbekannter Befehl!\r\n";
+const char timer_msg_1[] PROGMEM = "\r\nTimer ";
+const char timer_msg_2[] PROGMEM = ": zuletzt ";
+const char timer_msg_3[] PROGMEM = "us verspaetet";
+const char timer_dropped_msg[] PROGMEM = "\r\nVerlorene Timer-Ereignisse: ";
 
 
 
@@ -76,12 +100,27 @@ typedef struct {
 	uint32_t timeout;           // Timer timeout in ticks
 	uint32_t last_tick;         // When the timer was last triggered
 	void (*callback)(void);     // Function to call when the timer expires
+	uint32_t lateness;          // Ticks between expiry and callback at the last dispatch
 	uint8_t active;             // Timer active flag (1 = active, 0 = inactive)
 } VirtualTimer;
 
 // Array of virtual timers
 VirtualTimer timers[MAX_TIMERS];
 
+// Expired timer, handed from the ISR to dispatchTimers()
+typedef struct {
+	uint8_t timer_index;        // Timer that expired
+	uint32_t deadline;          // Tick at which it expired
+} TimerEvent;
+
+// Single producer (TIMER1_COMPA_vect) / single consumer (main loop) queue of expired timers
+// Only the ISR writes head and only the main loop writes tail, both are single bytes
+// so no locking is needed. The indices run freely and are masked on access.
+volatile TimerEvent timer_events[TIMER_EVENT_QUEUE_SIZE];
+volatile uint8_t timer_event_head = 0; // Next write position (ISR)
+volatile uint8_t timer_event_tail = 0; // Next read position (main loop)
+volatile uint16_t timer_events_dropped = 0; // Expiries lost because the queue was full
+
 // Function to declare a timer
 void declareTimer(uint8_t timer_index, uint32_t timeout_us, void (*callback)(void)) {
 	if (timer_index < MAX_TIMERS) {
@@ -93,8 +132,34 @@ void declareTimer(uint8_t timer_index, uint32_t timeout_us, void (*callback)(voi
 
 // Function to start or restart a timer
 void startTimer(uint8_t timer_index) {
-	timers[timer_index].last_tick = virtual_timer_ticks; // Set last tick to current time
-	timers[timer_index].active = 1;  // Set timer as active
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		timers[timer_index].last_tick = virtual_timer_ticks; // Set last tick to current time
+		timers[timer_index].active = 1;  // Set timer as active
+	}
+}
+
+// Run the callbacks of all expired timers, called from the main loop
+// Returns the number of callbacks that were run
+uint8_t dispatchTimers() {
+	uint8_t count = 0;
+	uint8_t tail = timer_event_tail;
+	
+	while (tail != timer_event_head) {
+		uint8_t timer_index = timer_events[tail & (TIMER_EVENT_QUEUE_SIZE - 1)].timer_index;
+		uint32_t deadline = timer_events[tail & (TIMER_EVENT_QUEUE_SIZE - 1)].deadline;
+		timer_event_tail = ++tail; // Free the entry before the callback, the ISR may refill it
+		
+		if (!timers[timer_index].active) continue; // Cancelled after it expired
+		
+		uint32_t now;
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			now = virtual_timer_ticks;
+		}
+		timers[timer_index].lateness = now - deadline; // How late the callback runs
+		timers[timer_index].callback();
+		count++;
+	}
+	return count;
 }
 
 // Function to cancel (stop) a timer
@@ -105,41 +170,10 @@ void cancelTimer(uint8_t timer_index) {
 
 
 // ######################################################################################
-// RINGBUFFER FUNCTIONS
+// RINGBUFFERS (type and functions in Common/ringbuffer.h)
 // ######################################################################################
 
-typedef struct {
-	uint8_t buffer[RINGBUFFER_SIZE];
-	uint8_t head; // Pointer to the next write position in the buffer
-	uint8_t tail; // Pointer to the next read position in the buffer
-	uint8_t size; // Tracks the number of elements currently in the buffer
-} RingBuffer;
-
-volatile RingBuffer rb;
-
-// Initialize an empty ring buffer
-void ringBufferInit() {
-	rb.head = rb.tail = 0;
-	rb.size = 0;
-}
-
-// Write data to the buffer
-void ringBufferWrite(uint8_t data) {
-	rb.buffer[rb.head] = data; // Write the data to the buffer at the head position
-	rb.head = (rb.head + 1) % RINGBUFFER_SIZE; // Move the head pointer to the next position, wrapping around if needed
-	rb.size++; // Increment the size of the buffer
-}
-
-// Read data from the buffer
-uint8_t ringBufferRead() {
-	uint8_t data = 0;
-	if (rb.size > 0) { // Check if the buffer is not empty
-		data = rb.buffer[rb.tail]; // Read the data from the buffer at the tail position
-		rb.tail = (rb.tail + 1) % RINGBUFFER_SIZE; // Move the tail pointer to the next position, wrapping around if needed
-		rb.size--; // Decrement the size of the buffer
-	}
-	return data;
-}
+RINGBUFFER(rx_buffer, RINGBUFFER_SIZE);
 
 
 
@@ -166,9 +200,9 @@ void USART_Transmit(unsigned char data){
 
 // Read received char from Ringbuffer
 unsigned char USART_Receive(){
-	while(rb.size == 0); // Wait until there is something in the Buffer
-	uint8_t data = ringBufferRead();
-	if(rb.size <= RINGBUFFER_LOW_LIMIT && flowcontrol == 0) {
+	while(ringBufferCount(&rx_buffer) == 0) dispatchTimers(); // Run expired timers until there is something in the Buffer
+	uint8_t data = ringBufferRead(&rx_buffer);
+	if(ringBufferCount(&rx_buffer) <= RINGBUFFER_LOW_LIMIT && flowcontrol == 0) {
 		USART_Transmit(XON);
 		flowcontrol = 1;
 	}
@@ -190,6 +224,23 @@ void USART_puts_P(const char *str) {
 	}
 }
 
+// Send unsigned number as decimal string, digits go straight to the UART so no buffer can overflow
+void USART_putU32(uint32_t val) {
+	static const uint32_t pow10[9] PROGMEM = {1000000000UL, 100000000UL, 10000000UL, 1000000UL, 100000UL, 10000UL, 1000UL, 100UL, 10UL};
+	uint8_t started = 0;
+	for (uint8_t i = 0; i < 9; i++) {
+		uint32_t p = pgm_read_dword(&pow10[i]);
+		char digit = '0';
+		while (val >= p) { // Subtract instead of a 32 bit division
+			val -= p;
+			digit++;
+		}
+		if (digit != '0') started = 1;
+		if (started) USART_Transmit(digit);
+	}
+	USART_Transmit('0' + val);
+}
+
 // Show start menu
 void showMenu() {
 	USART_puts_P(menu_str);
@@ -242,6 +293,7 @@ void processCommand(uint8_t cmd) {
 	switch (cmd) {
 		case 'a': // Start
 			led_counter = start_time; // Reset Stoppwatch to Starttime
+			PORTB = (PORTB & ~(0b00000111)) | led_counter; // Update LEDs
 			startTimer(0); // Start LED counter timer
 			stopwatch_active = 1;
 			USART_puts_P(start_msg);
@@ -249,11 +301,10 @@ void processCommand(uint8_t cmd) {
 		case 'b': // Stop
 			cancelTimer(0); // Stop LED counter timer
 			stopwatch_active = 0;
-			char b_buffer_1[4]; char b_buffer_2[4];
 			USART_puts_P(stop_msg_1);
-			USART_puts(itoa(stopwatch_counter, b_buffer_1, 10));
+			USART_putU32(stopwatch_counter);
 			USART_puts_P(stop_msg_2);
-			USART_puts(itoa(flip_int_first_3bit(led_counter), b_buffer_2, 10));
+			USART_putU32(flip_int_first_3bit(led_counter));
 			USART_Transmit('\r');
 			USART_Transmit('\n');
 			stopwatch_counter = 0;
@@ -265,11 +316,29 @@ void processCommand(uint8_t cmd) {
 		}
 		case 'd': // Show current Starttime
 			USART_puts_P(show_time_msg);
-			char d_buffer_1[4];
-			USART_puts(itoa(flip_int_first_3bit(start_time), d_buffer_1, 10));
+			USART_putU32(flip_int_first_3bit(start_time));
 			USART_Transmit('\r');
 			USART_Transmit('\n');
 			break;
+		case 't': { // Show how late the timer callbacks ran
+			for (uint8_t i = 0; i < MAX_TIMERS; i++) {
+				if (!timers[i].callback) continue; // Not declared
+				USART_puts_P(timer_msg_1);
+				USART_putU32(i);
+				USART_puts_P(timer_msg_2);
+				USART_putU32(timers[i].lateness * 256); // Ticks of 256 us
+				USART_puts_P(timer_msg_3);
+			}
+			uint16_t dropped;
+			ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+				dropped = timer_events_dropped;
+			}
+			USART_puts_P(timer_dropped_msg);
+			USART_putU32(dropped);
+			USART_Transmit('\r');
+			USART_Transmit('\n');
+			break;
+		}
 		case 'h': // Show Menu
 			showMenu();
 			break;
@@ -296,6 +365,8 @@ void event_count_leds() {
 	} else {
 		led_counter = 0;
 	}
+	
+	PORTB = (PORTB & ~(0b00000111)) | led_counter; // Update LEDs 
 }
 
 
@@ -313,22 +384,26 @@ ISR(TIMER1_COMPA_vect) {
 	// Check each virtual timer
 	for (uint8_t i = 0; i < MAX_TIMERS; i++) {
 		if (timers[i].active && virtual_timer_ticks - timers[i].last_tick >= timers[i].timeout) {
-			// Timer expired -> call callback
-			// USART_Transmit('-'); // Debug
-			timers[i].callback();
+			// Timer expired -> hand the callback over to the main loop
+			uint8_t head = timer_event_head;
+			if ((uint8_t)(head - timer_event_tail) < TIMER_EVENT_QUEUE_SIZE) {
+				timer_events[head & (TIMER_EVENT_QUEUE_SIZE - 1)].timer_index = i;
+				timer_events[head & (TIMER_EVENT_QUEUE_SIZE - 1)].deadline = virtual_timer_ticks;
+				timer_event_head = head + 1; // Publish the entry after it is complete
+			} else {
+				timer_events_dropped++;
+			}
 			timers[i].last_tick = virtual_timer_ticks;
 		}
 	}
-	
-	PORTB = (PORTB & ~(0b00000111)) | led_counter; // Update LEDs 
 }
 
 // UART RX ISR
 ISR(USART_RX_vect) {
 	uint8_t data = UDR0; // The received character is ready here.
-	ringBufferWrite(data);
+	ringBufferWrite(&rx_buffer, data); // Dropped if the buffer is full
 	
-	if(rb.size >= RINGBUFFER_HIGH_LIMIT && flowcontrol == 1) {
+	if(ringBufferCount(&rx_buffer) >= RINGBUFFER_HIGH_LIMIT && flowcontrol == 1) {
 		USART_Transmit(XOFF);
 		flowcontrol = 0;
 	}
@@ -378,6 +453,11 @@ void timer_interrupt_init() {
 void USART_Init() {
 	UBRR0H = (BAUD_CONST >> 8);
 	UBRR0L = BAUD_CONST;
+#if BAUD_U2X
+	UCSR0A |= (1 << U2X0); // Double speed
+#else
+	UCSR0A &= ~(1 << U2X0);
+#endif
 	UCSR0B |= (1 << RXEN0) | (1 << TXEN0) | (1 << RXCIE0);
 	UCSR0C |= (1 << UCSZ01) | (1 << UCSZ00);
 }
@@ -391,7 +471,7 @@ int main() {
 	port_io_init();
 	timer_interrupt_init();
 	USART_Init();
-	ringBufferInit();
+	ringBufferInit(&rx_buffer);
 	
 	sei(); // Enable Interrupts
 
@@ -8,25 +8,106 @@
 #define F_CPU 16000000UL
 
 // Timer defines
-#define MAX_TIMERS 2
+#define MAX_TIMERS 8 // Size of the timer pool shared by all modules (max. 255)
+#define TIMER_INVALID 0 // Returned by timer_create() if the pool is full, never a valid handle
+#define TIMER_NONE 0xFF // End marker of the timer delta queue
+#define TIMER1_PRESCALER 64 // Timer1 clock = F_CPU / 64 = 250 kHz (4 us per count)
+#define TIMER_TICK_COUNTS 64 // Timer1 counts per virtual timer tick (64 * 4 us = 256 us at prescaler 64)
+#define TIMER_MAX_TICKS 0x00FFFFFFUL // Longest period in ticks (~71 minutes)
+#define TIMER_MAX_ERROR_PERMILLE 5 // Max. deviation of a rounded timer period from the requested one
+
+// Tickless mode: 1 = Timer1 runs freely and OCR1A is moved to the next deadline,
+// 0 = CTC mode with an interrupt on every tick
+#define TIMER_TICKLESS 1
+#define TIMER_MAX_HOP 1023 // Max. ticks between two compare interrupts (1023 * 64 counts < 2^16)
+#define TIMER_MIN_LEAD 4   // Min. Timer1 counts between now and a newly programmed compare value
+#define TIMER_EVENT_QUEUE_SIZE 8 // Expired timers waiting for dispatch (power of two)
+#define TIMER_PERIODIC 0 // Timer restarts itself, next deadline = previous deadline + timeout
+#define TIMER_ONESHOT 1  // Timer fires once and disarms itself
+
+// Idle mode: 1 = sleep until the next interrupt when there is nothing to do,
+// 0 = keep spinning. Both modes count the idle loops, their time is calibrated at startup.
+#define IDLE_SLEEP 1
+#define IDLE_CALIBRATION_LOOPS 256 // Idle loops measured at startup to get the time per loop
+#define IDLE_CALIBRATION_BATCH 8   // Idle loops per measurement, measured again if an interrupt ran
+
+// Static timers, created at compile time and stored in flash
+// X(name, period in us, mode, callback) - 'name' becomes the handle of the timer
+#define STATIC_TIMERS(X) \
+	X(TIMER_LED_COUNTER, 1000000, TIMER_PERIODIC, event_count_leds) /* 1-second timer to count LEDs */ \
+	X(TIMER_SETTINGS_FLUSH, SETTINGS_IDLE_US, TIMER_ONESHOT, event_settings_flush) /* Saves changed settings */
 #define C_MAX 7
 
 // UART defines
 #define BAUDRATE 9600
-#define BAUD_CONST (((F_CPU/(BAUDRATE*16UL)))-1)
+#define BAUD_MAX_ERROR_PERMILLE 25 // Max. deviation of the real baud rate (2.5 %, 115200 with U2X has 2.1 %)
+// Rounded UBRR for normal (16 samples per bit) and double speed mode (U2X0, 8 samples per bit)
+#define BAUD_UBRR_16 ((F_CPU + 8UL * BAUDRATE) / (16UL * BAUDRATE) - 1)
+#define BAUD_UBRR_8  ((F_CPU + 4UL * BAUDRATE) / (8UL * BAUDRATE) - 1)
+#define BAUD_ERROR_16 (BAUD_ERROR(16UL * BAUDRATE * (BAUD_UBRR_16 + 1)))
+#define BAUD_ERROR_8  (BAUD_ERROR(8UL * BAUDRATE * (BAUD_UBRR_8 + 1)))
+#define BAUD_ERROR(clk) (((clk) > F_CPU ? (clk) - F_CPU : F_CPU - (clk)) * 1000 / (clk)) // Permille
+// Double speed only if it is more accurate, normal mode samples more often and tolerates more noise
+#define BAUD_U2X (BAUD_ERROR_8 < BAUD_ERROR_16)
+#define BAUD_CONST (BAUD_U2X ? BAUD_UBRR_8 : BAUD_UBRR_16)
+#define BAUD_ERROR_PERMILLE (BAUD_U2X ? BAUD_ERROR_8 : BAUD_ERROR_16)
+#if BAUD_ERROR_PERMILLE > BAUD_MAX_ERROR_PERMILLE
+#error "BAUDRATE cannot be reached with this F_CPU"
+#endif
+#if BAUD_CONST > 4095
+#error "BAUDRATE too low for this F_CPU"
+#endif
 
 // Ring buffer parameters
-#define RINGBUFFER_SIZE 32
-#define RINGBUFFER_HIGH_LIMIT 20
-#define RINGBUFFER_LOW_LIMIT 4
+#define RINGBUFFER_SIZE 32 // Receive buffer (power of two, max. 128)
+#define FLOW_HEADROOM 12   // Bytes that may still arrive after the sender was stopped (its FIFO + reaction time)
+#define RINGBUFFER_HIGH_LIMIT (RINGBUFFER_SIZE - FLOW_HEADROOM) // Stop the sender at this fill level
+#define RINGBUFFER_LOW_LIMIT (RINGBUFFER_SIZE / 8)              // Let it continue at this fill level
+#define TX_BUFFER_SIZE 64 // Transmit buffer for copied bytes, drained by the UDRE interrupt (power of two, max. 128)
+#define TX_QUEUE_SIZE 16  // Entries of the transmit queue (power of two, max. 128)
+#define TX_INLINE_SIZE 12 // Chars stored in a queue entry itself, enough for "-4294967.295"
+
+// What happens when a UART buffer is full
+#define OVERFLOW_DROP_NEWEST 0 // Discard the byte that does not fit
+#define OVERFLOW_DROP_OLDEST 1 // Discard the oldest byte in the buffer to make room (RX only)
+#define OVERFLOW_BLOCK 2       // RX: leave the byte in UDR0 until there is room (hardware overrun if more follow), TX: wait
+#define RX_OVERFLOW_POLICY OVERFLOW_DROP_NEWEST
+#define TX_OVERFLOW_POLICY OVERFLOW_BLOCK
 
 // UART Flowcontrol
+#define FLOW_NONE 0    // No flow control, the receive buffer may overflow
+#define FLOW_XONXOFF 1 // XON/XOFF chars in the data stream (text only, the chars cannot be part of the data)
+#define FLOW_RTSCTS 2  // RTS/CTS lines, active low: RTS = we can receive, CTS = the other side can receive
+#define FLOW_CONTROL FLOW_XONXOFF
 #define XON  0x11
 #define XOFF 0x13
 
+// RTS/CTS pins (FLOW_RTSCTS), CTS needs a pin change interrupt to restart the transmission
+#define RTS_DDR DDRD
+#define RTS_PORT PORTD
+#define RTS_PIN PD6
+#define CTS_DDR DDRD
+#define CTS_PORT PORTD
+#define CTS_PINS PIND
+#define CTS_PIN PD7
+#define CTS_PCMSK PCMSK2
+#define CTS_PCIE PCIE2
+#define CTS_PCINT PCINT23
+#define CTS_vect PCINT2_vect
+
 // LED Starttime
 // Number (0-7) at which the LED couter starts
 #define STARTTIME 6
+#define SETTINGS_IDLE_US 2000000 // Changed settings are written to the EEPROM after 2 s without further changes
+#define STARTTIME_COUNTER ((((STARTTIME) & 1) << 2) | ((STARTTIME) & 2) | (((STARTTIME) >> 2) & 1)) // Flipped for the LED counter
+
+// Key-value store in the EEPROM, two banks that are written as a log one after the other
+#define KV_KEYS 8     // Keys 0 to KV_KEYS - 1
+#define KV_MAX_LEN 8  // Longest value in bytes
+#define KV_BANK_SIZE ((E2END + 1) / 2)
+
+// EEPROM write queue, drained by EE_READY_vect
+#define EEPROM_QUEUE_SIZE 32 // Queued byte operations (power of two, max. 128)
 
 
 #include <stdint.h>
@@ -35,16 +116,24 @@
 #include <avr/interrupt.h>
 #include <avr/pgmspace.h>
 #include <avr/eeprom.h>
+#include <avr/sleep.h>
+#include <util/atomic.h>
+#include <util/crc16.h>
+#include "../../../Common/ringbuffer.h"
 
 
 // Global Variables for LEDs and Timer
 volatile uint8_t led_counter = 0; // Current value of LEDs
-volatile uint32_t virtual_timer_ticks = 0; // Counts �s ticks
-uint8_t EEMEM start_time = STARTTIME; // Starttime (0-7) - At Address 0
+volatile uint32_t virtual_timer_ticks = 0; // Counts 256 µs ticks (in tickless mode up to the last compare match)
+volatile uint32_t virtual_timer_wraps = 0; // Overflows of virtual_timer_ticks (upper 32 bit of the 64 bit tick count)
+volatile uint16_t timer_base = 0; // TCNT1 value that belongs to virtual_timer_ticks (tickless mode)
+volatile uint16_t timer_hop = 1; // Ticks from timer_base to the programmed compare match
 
 
 // Global Variables for UART
-volatile uint8_t flowcontrol = 1; // 0 = XOFF, 1 = XON
+volatile uint8_t flowcontrol = 1; // 0 = receiving stopped (XOFF sent / RTS inactive), 1 = receiving
+volatile uint8_t tx_xoff = 0; // 1 = the other side sent XOFF, transmission paused (FLOW_XONXOFF)
+volatile uint8_t tx_priority = 0; // XON/XOFF waiting to be sent before the transmit buffer, 0 = none
 
 
 
@@ -54,21 +143,68 @@ volatile uint8_t flowcontrol = 1; // 0 = XOFF, 1 = XON
 
 const char menu_str[] PROGMEM =
 "\r\n----- Stoppuhr-Menu -----\r\n"
-"a: Stoppuhr starten\r\n"
-"b: Stoppuhr stoppen und Zeit ausgeben\r\n"
-"c: Startzeit einstellen\r\n"
-"d: Aktuell eingestellte Startzeit anzeigen\r\n"
-"h: Dieses Menu anzeigen\r\n"
+"a, start: Stoppuhr starten\r\n"
+"b, stop: Stoppuhr stoppen und Zeit ausgeben\r\n"
+"c, set <0-7>: Startzeit einstellen\r\n"
+"d, show: Aktuell eingestellte Startzeit anzeigen\r\n"
+"e, eeprom <0-1023>: EEPROM-Byte anzeigen\r\n"
+"t, timers: Timer-Statistik anzeigen\r\n"
+"l, load: CPU-Auslastung und ISR-Laufzeiten anzeigen\r\n"
+"u, uart: UART-Fehler und Pufferfuellstand anzeigen\r\n"
+"r, reset: Statistiken zuruecksetzen\r\n"
+"w, save: Einstellungen sofort speichern\r\n"
+"k, kv: Zustand des Key-Value-Speichers anzeigen\r\n"
+"h, help: Dieses Menu anzeigen\r\n"
+"Befehle mit Enter abschliessen, z.B. \"c 5\"\r\n"
 "--------------------------\r\n";
 
 const char prompt_str[] PROGMEM = "\r\nEingabe: ";
 const char start_msg[] PROGMEM = "\r\nStoppuhr gestartet.\r\n";
 const char stop_msg_1[] PROGMEM = "\r\nStoppuhr gestoppt.\r\nGestoppte Zeit: ";
 const char stop_msg_2[] PROGMEM = "s\r\nLED Counter Wert: ";
-const char set_time_msg[] PROGMEM = "\r\nGeben Sie die Startzeit (0-7) ein: ";
+const char set_time_msg[] PROGMEM = "\r\nNeue Startzeit: ";
 const char show_time_msg[] PROGMEM = "\r\nAktuell eingestellte Startzeit: ";
-const char invalid_time_msg[] PROGMEM = "\r\nUngueltige Zeit! Bitte zwischen 0 und 7 eingeben.\r\n";
 const char unknown_cmd_msg[] PROGMEM = "\r\nUnbekannter Befehl!\r\n";
+const char invalid_input_msg[] PROGMEM = "\r\nUngueltige Eingabe!\r\n";
+const char no_arg_msg[] PROGMEM = "\r\nDieser Befehl erwartet keinen Wert!\r\n";
+const char range_msg_1[] PROGMEM = "\r\nBitte einen Wert zwischen ";
+const char range_msg_2[] PROGMEM = " und ";
+const char range_msg_3[] PROGMEM = " angeben!\r\n";
+const char save_msg[] PROGMEM = "\r\nEinstellungen werden gespeichert.\r\n";
+const char kv_bank_msg[] PROGMEM = "\r\nKV-Speicher: Bank ";
+const char kv_generation_msg[] PROGMEM = ", Generation ";
+const char kv_keys_msg[] PROGMEM = ", Schluessel ";
+const char kv_used_msg[] PROGMEM = ", belegt ";
+const char kv_compactions_msg[] PROGMEM = " Bytes, Kompaktierungen ";
+const char kv_pending_msg[] PROGMEM = ", Schreiben laeuft";
+const char kv_scan_msg[] PROGMEM = "\r\nIndex beim Start: ";
+const char kv_scan_time_msg[] PROGMEM = " Bytes gelesen in ";
+const char eeprom_msg_1[] PROGMEM = "\r\nEEPROM[";
+const char eeprom_msg_2[] PROGMEM = "] = 0x";
+const char stats_timer_msg[] PROGMEM = "\r\nTimer ";
+const char stats_runs_msg[] PROGMEM = ": Aufrufe ";
+const char stats_mean_msg[] PROGMEM = ", Verspaetung Mittel ";
+const char stats_max_msg[] PROGMEM = "us, Max ";
+const char stats_missed_msg[] PROGMEM = "us, Verpasst ";
+const char stats_reset_msg[] PROGMEM = "\r\nStatistiken zurueckgesetzt.\r\n";
+const char load_time_msg[] PROGMEM = "\r\nLaufzeit: ";
+const char load_idle_msg[] PROGMEM = "ms, Leerlauf: ";
+const char load_percent_msg[] PROGMEM = "ms, CPU-Auslastung: ";
+const char load_isr_msg[] PROGMEM = "\r\nISR ";
+const char load_count_msg[] PROGMEM = ": Aufrufe ";
+const char load_mean_msg[] PROGMEM = ", Mittel ";
+const char load_max_msg[] PROGMEM = ", Max ";
+const char load_share_msg[] PROGMEM = ", Anteil ";
+const char load_unit_msg[] PROGMEM = "\r\nISR-Laufzeiten in Timer1-Schritten zu 4 us (64 Takte), kurze ISRs liegen unter einem Schritt";
+const char uart_overrun_msg[] PROGMEM = "\r\nUART Overrun: ";
+const char uart_framing_msg[] PROGMEM = ", Rahmenfehler: ";
+const char uart_parity_msg[] PROGMEM = ", Paritaetsfehler: ";
+const char uart_rx_drop_msg[] PROGMEM = "\r\nRX verworfen: ";
+const char uart_rx_max_msg[] PROGMEM = ", RX max. Fuellstand: ";
+const char uart_tx_drop_msg[] PROGMEM = "\r\nTX verworfen: ";
+const char uart_tx_max_msg[] PROGMEM = ", TX max. Fuellstand: ";
+const char uart_tx_queue_msg[] PROGMEM = ", Eintraege max.: ";
+const char uart_xoff_msg[] PROGMEM = "\r\nEmpfang angehalten: ";
 
 
 
@@ -76,16 +212,6 @@ const char unknown_cmd_msg[] PROGMEM = "\r\nUnbekannter Befehl!\r\n";
 // VARIOUS CONVERSION FUNCTION
 // ######################################################################################
 
-// Converts an ASCII char to a single digit uint8_t
-uint8_t ascii_to_int(uint8_t c){
-	return (c-48);
-}
-
-// Converts a single digit uint8_t to an ASCII char
-uint8_t int_to_ascii(uint8_t c){
-	return (c+48);
-}
-
 uint8_t flip_int_first_3bit(uint32_t val){
 	// Extract the lowest 3 bits
 	uint8_t lowest3 = val & 0x07;
@@ -96,55 +222,537 @@ uint8_t flip_int_first_3bit(uint32_t val){
 	return flipped;
 }
 
-uint8_t flip_3bit_ascii_for_counter(uint8_t a){
-	return int_to_ascii(flip_int_first_3bit(ascii_to_int(a)));
-}
-
 
 
 // ######################################################################################
 // EEPROM FUNCTIONS
 // ######################################################################################
 
-// Write a single byte to EEPROM
-void EEPROM_write(uint16_t address, uint8_t data){
-	// Wait for completion of any previous write operation
-	// Wait until EEPE is cleared = EEPROM is ready
+// Read a single byte from EEPROM
+// EE_READY_vect may start a write at any time, so the check and the read are done with interrupts disabled
+uint8_t EEPROM_read(uint16_t address){
+	while (1) {
+		// Wait for completion of any previous write operation
+		while (EECR & (1 << EEPE)); // Wait until EEPE is cleared
+		
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			if (!(EECR & (1 << EEPE))) {
+				EEAR = address; // Set up address register
+				EECR |= (1 << EERE); // Start the read by setting EERE
+				return EEDR;
+			}
+		}
+	}
+}
+
+// EEPROM programming modes (EEPM bits)
+#define EEPROM_MODE_ERASE_WRITE 0      // Erase and write in one operation (3.4 ms)
+#define EEPROM_MODE_ERASE (1 << EEPM0) // Only erase, the byte becomes 0xFF (1.8 ms)
+#define EEPROM_MODE_WRITE (1 << EEPM1) // Only write, can only clear bits of an erased byte (1.8 ms)
+
+// Start an EEPROM operation in the given mode, does not wait until it is finished
+void EEPROM_writeMode(uint16_t address, uint8_t data, uint8_t mode){
 	while (EECR & (1 << EEPE)) ;
 
-	EEAR = address; // Set up address register
-	EEDR = data; // Set up data register
+	EEAR = address;
+	EEDR = data;
 
-	// Write enable sequence
-	EECR |= (1 << EEMPE); // Set EEMPE
-	EECR |= (1 << EEPE); // Set EEP to start write
+	// EEPE has to follow EEMPE within 4 cycles, EERIE is kept
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		EECR = (EECR & (1 << EERIE)) | mode | (1 << EEMPE);
+		EECR |= (1 << EEPE);
+	}
 }
 
-// Read a single byte from EEPROM
-uint8_t EEPROM_read(uint16_t address){
-	// Wait for completion of any previous write operation
-	while (EECR & (1 << EEPE)); // Wait until EEPE is cleared
+// Write queue
+// Callers queue byte operations and continue right away, EE_READY_vect starts one operation
+// each time the EEPROM becomes ready (3.4 ms per byte). Bytes that already hold the
+// result are skipped. Reads through EEPROM_readCurrent() see the queued values.
+// The operations run in order, so a flag that is set once the last byte of a write is
+// finished means that everything queued before it is in the EEPROM as well.
+typedef struct {
+	uint16_t address;
+	uint8_t data;
+	uint8_t mode;               // EEPROM_MODE_...
+	volatile uint8_t *done;     // Set to 1 once this operation is finished, 0 = none
+} EepromOp;
+
+_Static_assert((EEPROM_QUEUE_SIZE & (EEPROM_QUEUE_SIZE - 1)) == 0 && EEPROM_QUEUE_SIZE <= 128, "EEPROM_QUEUE_SIZE must be a power of two <= 128");
+
+volatile EepromOp eeprom_queue[EEPROM_QUEUE_SIZE];
+volatile uint8_t eeprom_queue_head = 0; // Written by the main loop only
+volatile uint8_t eeprom_queue_tail = 0; // Written by EE_READY_vect only
+volatile uint8_t *volatile eeprom_done = 0; // Flag of the operation in progress
+volatile uint16_t eeprom_active_address = 0xFFFF; // Byte that is being written (0xFFFF = none)
+volatile uint8_t eeprom_active_result = 0xFF;     // Its value once the operation is finished
+
+uint8_t EEPROM_queueFree(){
+	return EEPROM_QUEUE_SIZE - (uint8_t)(eeprom_queue_head - eeprom_queue_tail);
+}
+
+// Queue one operation, returns 0 if the queue is full
+// '*done' (if given) becomes 1 once the operation is finished. A flag that still belongs to an
+// older operation moves to this one, so it stays 0 until the newest operation using it is done.
+uint8_t EEPROM_queue(uint16_t address, uint8_t data, uint8_t mode, volatile uint8_t *done){
+	if (EEPROM_queueFree() == 0) return 0;
+	if (done) {
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			for (uint8_t i = eeprom_queue_tail; i != eeprom_queue_head; i++) {
+				volatile EepromOp *older = &eeprom_queue[i & (EEPROM_QUEUE_SIZE - 1)];
+				if (older->done == done) older->done = 0;
+			}
+			if (eeprom_done == done) eeprom_done = 0;
+			*done = 0;
+		}
+	}
+	volatile EepromOp *op = &eeprom_queue[eeprom_queue_head & (EEPROM_QUEUE_SIZE - 1)];
+	op->address = address;
+	op->data = data;
+	op->mode = mode;
+	op->done = done;
+	eeprom_queue_head++;
+	EECR |= (1 << EERIE); // EE_READY_vect fires as soon as the EEPROM is ready
+	return 1;
+}
+
+// Queue 'len' bytes in the given mode, '*done' (if given) becomes 1 once all of them are written
+// Returns 0 and queues nothing if there is not enough room
+uint8_t EEPROM_writeAsync(uint16_t address, const uint8_t *data, uint8_t len, uint8_t mode, volatile uint8_t *done){
+	if (len > EEPROM_queueFree()) return 0;
+	if (len == 0) {
+		if (done) *done = 1;
+		return 1;
+	}
+	for (uint8_t i = 0; i < len; i++) {
+		EEPROM_queue(address + i, data[i], mode, i == len - 1 ? done : 0);
+	}
+	return 1;
+}
+
+// Value of a byte after all queued operations, without waiting for them
+uint8_t EEPROM_readCurrent(uint16_t address){
+	uint8_t tail = eeprom_queue_tail;
+	uint8_t head = eeprom_queue_head;
+	
+	// The newest operation on the address decides, older ones are overwritten by it.
+	// Slots the interrupt already took keep their content until the main loop refills them.
+	uint8_t val = 0;
+	uint8_t found = 0;
+	while (head != tail) {
+		volatile EepromOp *op = &eeprom_queue[--head & (EEPROM_QUEUE_SIZE - 1)];
+		if (op->address != address) continue;
+		if (op->mode == EEPROM_MODE_ERASE) return found ? val : 0xFF;
+		if (op->mode == EEPROM_MODE_ERASE_WRITE) return found ? val & op->data : op->data;
+		// Write only: clears bits of what was there before
+		val = found ? val & op->data : op->data;
+		found = 1;
+	}
+	
+	// The EEPROM cannot be read during a write, but the byte being written is known.
+	// Reads of other addresses have to wait until the write is finished.
+	uint8_t active = 0;
+	uint8_t current = 0;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		if (eeprom_active_address == address) {
+			current = eeprom_active_result;
+			active = 1;
+		}
+	}
+	if (!active) current = EEPROM_read(address);
+	return found ? val & current : current;
+}
+
+
+
+// ######################################################################################
+// TIMER FUNCTIONS
+// ######################################################################################
+
+// Structure to represent each virtual timer
+// Active timers are kept in a delta queue sorted by expiry. Every entry only stores
+// the ticks remaining after its predecessor expires, so the ISR just has to count
+// down the head entry instead of checking every timer on every tick.
+typedef struct {
+	uint32_t timeout;           // Timer timeout in ticks
+	uint32_t delta;             // Ticks after the previous entry in the queue expires
+	void (*callback)(void *ctx); // Function to call when the timer expires
+	void *ctx;                  // User context passed to the callback
+	uint32_t runs;              // Number of dispatched callbacks
+	uint32_t late_sum;          // Sum of all callback delays in us (mean = late_sum / runs)
+	uint32_t late_max;          // Longest callback delay in us
+	uint16_t missed;            // Expiries without callback (previous one still pending or queue full)
+	uint8_t next;               // Next timer in the delta queue (TIMER_NONE = end of queue)
+	uint8_t mode;               // TIMER_PERIODIC or TIMER_ONESHOT
+	uint8_t epoch;              // Changed on start/cancel, events of an older epoch are dropped
+	uint8_t generation;         // Odd = slot in use, changed on create/destroy to invalidate old handles
+	uint8_t pending;            // Callback waits in the dispatch queue
+	uint8_t active;             // Timer active flag (1 = active and queued, 0 = inactive)
+} VirtualTimer;
+
+// Pool of virtual timers
+// The first STATIC_TIMER_COUNT slots belong to the static timers, the rest is handed out by timer_create()
+VirtualTimer timers[MAX_TIMERS];
+
+// Handle of a timer from the pool: generation of the slot in the high byte, slot in the low byte
+// A handle becomes stale as soon as the timer is destroyed, even if the slot is reused
+typedef uint16_t TimerHandle;
+
+// Length of one tick in CPU cycles, used to convert periods at compile time
+#define TIMER_TICK_CYCLES ((uint64_t)TIMER1_PRESCALER * TIMER_TICK_COUNTS)
+
+// Convert a period in us into ticks (rounded), only meant for constants so the compiler does the division
+#define TIMER_US_TO_TICKS(us) (((uint64_t)(us) * F_CPU + TIMER_TICK_CYCLES * 500000ULL) / (TIMER_TICK_CYCLES * 1000000ULL))
+
+// A period is representable if it is at least one tick, fits into TIMER_MAX_TICKS
+// and the rounding error stays below TIMER_MAX_ERROR_PERMILLE
+#define TIMER_US_ERROR(us) ((int64_t)(TIMER_US_TO_TICKS(us) * TIMER_TICK_CYCLES * 1000000ULL) - (int64_t)((uint64_t)(us) * F_CPU))
+#define TIMER_US_VALID(us) (TIMER_US_TO_TICKS(us) >= 1 && TIMER_US_TO_TICKS(us) <= TIMER_MAX_TICKS \
+	&& TIMER_US_ERROR(us) * 1000 <= (int64_t)((uint64_t)(us) * F_CPU * TIMER_MAX_ERROR_PERMILLE) \
+	&& -TIMER_US_ERROR(us) * 1000 <= (int64_t)((uint64_t)(us) * F_CPU * TIMER_MAX_ERROR_PERMILLE))
+
+#if F_CPU / TIMER1_PRESCALER != 250000
+#error "micros() and the clock snapshot assume 4 us Timer1 counts"
+#endif
+
+// Static timer table entry in flash
+typedef struct {
+	uint32_t ticks;             // Period in ticks, computed by the compiler
+	void (*callback)(void *ctx); // Function to call when the timer expires
+	uint8_t mode;               // TIMER_PERIODIC or TIMER_ONESHOT
+} StaticTimer;
+
+// Slots of the static timers
+#define STATIC_TIMER_SLOT(name, us, mode, callback) name##_SLOT,
+enum { STATIC_TIMERS(STATIC_TIMER_SLOT) STATIC_TIMER_COUNT };
 
-	EEAR = address; // Set up address register
-	EECR |= (1 << EERE); // Start the read by setting EERE
+// Handles of the static timers (generation 1, never destroyed)
+#define STATIC_TIMER_HANDLE(name, us, mode, callback) name = (1 << 8) | name##_SLOT,
+enum { STATIC_TIMERS(STATIC_TIMER_HANDLE) };
+
+// Every period has to be representable in ticks, otherwise the build fails
+#define STATIC_TIMER_CHECK(name, us, mode, callback) \
+	_Static_assert(TIMER_US_VALID(us), "Period of " #name " is out of range or not representable in timer ticks");
+STATIC_TIMERS(STATIC_TIMER_CHECK)
+_Static_assert(STATIC_TIMER_COUNT <= MAX_TIMERS, "More static timers than MAX_TIMERS");
+
+// Callbacks of the static timers are defined further down
+#define STATIC_TIMER_PROTOTYPE(name, us, mode, callback) void callback(void *ctx);
+STATIC_TIMERS(STATIC_TIMER_PROTOTYPE)
+
+#define STATIC_TIMER_ENTRY(name, us, mode, callback) { TIMER_US_TO_TICKS(us), callback, mode },
+const StaticTimer static_timers[STATIC_TIMER_COUNT] PROGMEM = { STATIC_TIMERS(STATIC_TIMER_ENTRY) };
+
+// Expired timer, handed from the ISR to dispatchTimers()
+typedef struct {
+	uint8_t timer_index;        // Timer that expired
+	uint8_t epoch;              // Epoch of the timer when it expired
+	uint32_t deadline;          // Time of expiry in us (micros())
+} TimerEvent;
+
+// Single producer (TIMER1_COMPA_vect) / single consumer (main loop) queue of expired timers
+// Only the ISR writes head and only the main loop writes tail, both are single bytes
+// so no locking is needed. The indices run freely and are masked on access.
+volatile TimerEvent timer_events[TIMER_EVENT_QUEUE_SIZE];
+volatile uint8_t timer_event_head = 0; // Next write position (ISR)
+volatile uint8_t timer_event_tail = 0; // Next read position (main loop)
+
+// First timer in the delta queue = the one that expires next
+volatile uint8_t timer_queue_head = TIMER_NONE;
+
+// Consistent snapshot of the monotonic clock
+// Taken with interrupts disabled (ATOMIC_RESTORESTATE), so it is safe in main and ISR context
+typedef struct {
+	uint32_t wraps;             // Overflows of the tick counter
+	uint32_t ticks;             // 256 us ticks
+	uint16_t counts;            // 4 us Timer1 counts since 'ticks' (may exceed one tick in tickless mode)
+} ClockSnapshot;
+
+ClockSnapshot clockSnapshot() {
+	ClockSnapshot snap;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		snap.wraps = virtual_timer_wraps;
+		snap.ticks = virtual_timer_ticks;
+#if TIMER_TICKLESS
+		// Timer1 runs freely, counts since the last compare match are always valid
+		// even if a compare match is pending but not yet handled
+		snap.counts = TCNT1 - timer_base;
+#else
+		// CTC mode: TCNT1 has already restarted if a compare match is pending
+		snap.counts = TCNT1;
+		if ((TIFR1 & (1 << OCF1A)) && snap.counts < TIMER_TICK_COUNTS - 1) snap.counts += TIMER_TICK_COUNTS;
+#endif
+	}
+	return snap;
+}
+
+// Current virtual timer tick
+// In tickless mode virtual_timer_ticks is only updated on compare matches,
+// the ticks since then are reconstructed from the free running Timer1
+uint32_t virtualTimerTicks() {
+	ClockSnapshot snap = clockSnapshot();
+	return snap.ticks + snap.counts / TIMER_TICK_COUNTS;
+}
+
+// Microseconds since start with 4 us resolution, wraps after ~71 minutes
+// Only 32 bit arithmetic: ticks * 256 us + counts * 4 us
+uint32_t micros() {
+	ClockSnapshot snap = clockSnapshot();
+	return (snap.ticks << 8) + ((uint32_t)snap.counts << 2);
+}
+
+// Timer1 counts (4 us) since start as 64 bit value, does not wrap
+uint64_t ticks64() {
+	ClockSnapshot snap = clockSnapshot();
+	return ((((uint64_t)snap.wraps << 32) | snap.ticks) * TIMER_TICK_COUNTS) + snap.counts;
+}
+
+#if TIMER_TICKLESS
+// Program OCR1A to the deadline of the queue head, but at most max_hop ticks after timer_base
+// The 16 bit compare arithmetic wraps together with TCNT1, so Timer1 overflows need no extra handling
+// Must be called with interrupts disabled
+void timerProgramNext(uint16_t max_hop) {
+	uint16_t hop = max_hop;
+	if (timer_queue_head != TIMER_NONE && timers[timer_queue_head].delta < hop) {
+		hop = timers[timer_queue_head].delta;
+	}
+	
+	// Never program a compare value that Timer1 has already passed
+	uint16_t now = TCNT1 - timer_base;
+	if ((uint16_t)(hop * TIMER_TICK_COUNTS) < now + TIMER_MIN_LEAD) {
+		hop = (now + TIMER_MIN_LEAD) / TIMER_TICK_COUNTS + 1;
+	}
 	
-	return EEDR;
+	timer_hop = hop;
+	OCR1A = timer_base + hop * TIMER_TICK_COUNTS;
 }
+#endif
 
-// Flip the STARTIME value in EEPROM to fit the LED Counter
-// EEPROM write only on very first startup of programm!!
-void EEPROM_init(){
-	// Read STARTIME value from EEPROM
-	uint8_t val = eeprom_read_byte(&start_time);
-	// If the value in EEPROM is the same as STARTIME define -> flip it
-	if(val == (uint8_t)STARTTIME) {
-		uint8_t val_flipped = flip_int_first_3bit(val); // Flip impoortant first 3 bits
-		eeprom_write_byte(&start_time, val_flipped); // Write flipped value back to EEPROM
-		led_counter = val_flipped; // Set counter variable to flipped value
+// Insert a timer into the delta queue so that it expires in 'ticks' ticks
+// Must be called with interrupts disabled
+void timerQueueInsert(uint8_t timer_index, uint32_t ticks) {
+	uint8_t prev = TIMER_NONE;
+	uint8_t cur = timer_queue_head;
+	
+	if (ticks == 0) ticks = 1; // Earliest possible expiry is the next tick
+	
+	// Walk past all timers expiring before (or together with) the new one
+	while (cur != TIMER_NONE && ticks >= timers[cur].delta) {
+		ticks -= timers[cur].delta;
+		prev = cur;
+		cur = timers[cur].next;
 	}
-	PORTB = (PORTB & ~(0b00000111)) | led_counter; // Update LEDs
+	
+	timers[timer_index].delta = ticks;
+	timers[timer_index].next = cur;
+	if (cur != TIMER_NONE) timers[cur].delta -= ticks; // Successor is now relative to the new timer
+	
+	if (prev == TIMER_NONE) {
+		timer_queue_head = timer_index;
+	} else {
+		timers[prev].next = timer_index;
+	}
+}
+
+// Remove a queued timer from the delta queue
+// Must be called with interrupts disabled
+void timerQueueRemove(uint8_t timer_index) {
+	uint8_t prev = TIMER_NONE;
+	uint8_t cur = timer_queue_head;
+	
+	while (cur != TIMER_NONE && cur != timer_index) {
+		prev = cur;
+		cur = timers[cur].next;
+	}
+	if (cur == TIMER_NONE) return; // Not queued
+	
+	uint8_t next = timers[cur].next;
+	if (next != TIMER_NONE) timers[next].delta += timers[cur].delta; // Hand remaining ticks to the successor
+	
+	if (prev == TIMER_NONE) {
+		timer_queue_head = next;
+	} else {
+		timers[prev].next = next;
+	}
+}
+
+// Look up the pool slot of a handle
+// Returns TIMER_NONE for invalid handles and for handles of destroyed timers
+uint8_t timerSlot(TimerHandle handle) {
+	uint8_t slot = handle & 0xFF;
+	if (slot >= MAX_TIMERS || timers[slot].generation != (uint8_t)(handle >> 8)) return TIMER_NONE;
+	return slot;
+}
+
+// Load the static timers from flash into their slots
+void timerInit() {
+	for (uint8_t slot = 0; slot < STATIC_TIMER_COUNT; slot++) {
+		timers[slot].timeout = pgm_read_dword(&static_timers[slot].ticks);
+		timers[slot].callback = (void (*)(void *))pgm_read_ptr(&static_timers[slot].callback);
+		timers[slot].ctx = 0;
+		timers[slot].mode = pgm_read_byte(&static_timers[slot].mode);
+		timers[slot].next = TIMER_NONE;
+		timers[slot].generation = 1; // In use for good, matches STATIC_TIMER_HANDLE
+	}
+}
+
+// Allocate a timer from the pool
+// The period is given in ticks, use TIMER_US_TO_TICKS() for constants
+// Returns TIMER_INVALID if all timers are in use
+TimerHandle timer_create(uint32_t ticks, uint8_t mode, void (*callback)(void *ctx), void *ctx) {
+	for (uint8_t slot = STATIC_TIMER_COUNT; slot < MAX_TIMERS; slot++) {
+		VirtualTimer *t = &timers[slot];
+		if (t->generation & 1) continue; // Odd generation = in use
+		
+		t->timeout = ticks ? ticks : 1; // Shortest possible period is one tick
+		t->callback = callback;
+		t->ctx = ctx;
+		t->mode = mode;
+		t->next = TIMER_NONE;
+		t->active = 0; // Timer is inactive by default
+		t->runs = t->late_sum = t->late_max = 0;
+		t->missed = 0;
+		t->generation++; // Now odd, old handles of this slot become stale
+		
+		return ((TimerHandle)t->generation << 8) | slot;
+	}
+	return TIMER_INVALID;
+}
+
+// Function to start or restart a timer
+// Returns 0 if the handle is stale
+uint8_t timer_start(TimerHandle handle) {
+	uint8_t timer_index = timerSlot(handle);
+	if (timer_index == TIMER_NONE) return 0;
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		if (timers[timer_index].active) timerQueueRemove(timer_index); // Restart = remove and queue again
+		timers[timer_index].epoch++; // Drop callbacks that are still pending from before the restart
+		timers[timer_index].pending = 0;
+#if TIMER_TICKLESS
+		// The queue counts from timer_base, add the ticks that already passed since then
+		timerQueueInsert(timer_index, timers[timer_index].timeout + (uint16_t)(TCNT1 - timer_base) / TIMER_TICK_COUNTS);
+		if (timer_queue_head == timer_index) timerProgramNext(TIMER_MAX_HOP); // New timer expires before the programmed compare match
+#else
+		timerQueueInsert(timer_index, timers[timer_index].timeout);
+#endif
+		timers[timer_index].active = 1;  // Set timer as active
+	}
+	return 1;
+}
+
+// Make sure the compare interrupt fires within 'ticks' ticks, e.g. to wake up the CPU for a task delay
+// Only needed in tickless mode, in CTC mode the interrupt fires on every tick anyway
+void timerWakeIn(uint32_t ticks) {
+#if TIMER_TICKLESS
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		uint32_t hop = (uint16_t)(TCNT1 - timer_base) / TIMER_TICK_COUNTS + ticks;
+		if (hop < timer_hop) timerProgramNext(hop); // The ISR copes with compare matches before the queue head expires
+	}
+#endif
+}
+
+// Function to cancel (stop) a timer
+// Returns 0 if the handle is stale
+uint8_t timer_cancel(TimerHandle handle) {
+	uint8_t timer_index = timerSlot(handle);
+	if (timer_index == TIMER_NONE) return 0;
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		if (timers[timer_index].active) timerQueueRemove(timer_index);
+		timers[timer_index].epoch++; // Drop callbacks that are still pending
+		timers[timer_index].pending = 0;
+		timers[timer_index].active = 0;  // Deactivate the timer
+	}
+	return 1;
+}
+
+// Stop a timer and give its slot back to the pool
+// Returns 0 if the handle is stale
+uint8_t timer_destroy(TimerHandle handle) {
+	if ((handle & 0xFF) < STATIC_TIMER_COUNT) return 0; // Static timers stay
+	if (!timer_cancel(handle)) return 0;
+	timers[handle & 0xFF].generation++; // Now even = free, the handle becomes stale
+	return 1;
+}
+
+// Run the callbacks of all expired timers, called from the main loop
+// Returns the number of callbacks that were run
+uint8_t dispatchTimers() {
+	uint8_t count = 0;
+	uint8_t tail = timer_event_tail;
+	
+	while (tail != timer_event_head) {
+		uint8_t timer_index = timer_events[tail & (TIMER_EVENT_QUEUE_SIZE - 1)].timer_index;
+		uint8_t epoch = timer_events[tail & (TIMER_EVENT_QUEUE_SIZE - 1)].epoch;
+		uint32_t deadline = timer_events[tail & (TIMER_EVENT_QUEUE_SIZE - 1)].deadline;
+		timer_event_tail = ++tail; // Free the entry before the callback, the ISR may refill it
+		
+		VirtualTimer *t = &timers[timer_index];
+		if (epoch != t->epoch) continue; // Cancelled, restarted or destroyed after it expired
+		t->pending = 0;
+		
+		// How late the callback runs
+		uint32_t late = micros() - deadline;
+		t->runs++;
+		t->late_sum += late;
+		if (late > t->late_max) t->late_max = late;
+		
+		t->callback(t->ctx);
+		count++;
+	}
+	return count;
 }
 
+// Reset the lateness statistics of all timers
+void resetTimerStats() {
+	for (uint8_t i = 0; i < MAX_TIMERS; i++) {
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			timers[i].runs = 0;
+			timers[i].late_sum = 0;
+			timers[i].late_max = 0;
+			timers[i].missed = 0;
+		}
+	}
+}
+
+
+
+// ######################################################################################
+// TASK SCHEDULER
+// ######################################################################################
+
+// Cooperative tasks in protothread style: every task is a function that returns whenever it
+// has to wait and continues at the same line on the next call. Tasks have no own stack,
+// so local variables do not survive a wait and have to be static or stored in the task.
+
+#define PT_WAITING 0 // Task waits for a condition
+#define PT_YIELDED 1 // Task gave up the CPU but could continue right away
+#define PT_ENDED 2   // Task reached its end and starts over on the next call
+
+typedef struct Task {
+	uint16_t lc;                        // Line at which the task continues (0 = beginning)
+	uint32_t wake;                      // Tick at which PT_DELAY() continues
+	uint8_t delaying;                   // Task waits in PT_DELAY(), the idle loop has to wake up in time
+	uint8_t (*run)(struct Task *task);  // Task function
+} Task;
+
+#define PT_BEGIN(task) switch ((task)->lc) { case 0:
+#define PT_END(task) } (task)->lc = 0; return PT_ENDED
+
+// Return to the scheduler until the condition is true
+#define PT_WAIT_UNTIL(task, cond) do { (task)->lc = __LINE__; case __LINE__: if (!(cond)) return PT_WAITING; } while (0)
+
+// Let the other tasks run once
+#define PT_YIELD(task) do { (task)->lc = __LINE__; return PT_YIELDED; case __LINE__:; } while (0)
+
+// Wait for a number of virtual timer ticks without blocking the other tasks
+#define PT_DELAY(task, ticks) do { \
+	(task)->wake = virtualTimerTicks() + (ticks); \
+	(task)->delaying = 1; \
+	PT_WAIT_UNTIL(task, (int32_t)(virtualTimerTicks() - (task)->wake) >= 0); \
+	(task)->delaying = 0; \
+} while (0)
+
 
 
 // ######################################################################################
@@ -155,78 +763,471 @@ volatile uint8_t stopwatch_active = 0;
 volatile uint32_t stopwatch_counter = 0;
 
 
+
 // ######################################################################################
-// TIMER FUNCTIONS
+// KEY-VALUE STORE
 // ######################################################################################
 
-// Structure to represent each virtual timer
+// Every value is appended to the active bank as a record, the newest record of a key counts:
+//   key, len, seq (16 bit), data[len], CRC16 over the bank generation and everything before
+// The CRC is written last, a reset in the middle of a record leaves a record with a wrong CRC
+// that ends the log, so the previous record of the key is used again.
+// When the bank is full, the other bank is erased and the newest record of every key is copied
+// into it. Its header (generation, inverted generation) is written last and makes it the active
+// bank, until then the old bank stays valid. A bank is only used after it was erased, so a half
+// written record can not be completed by the rest of an older record at the same address.
+// The EEPROM is only read by the boot scan, afterwards the values are served from RAM (kv_values).
+#define KV_HEADER_SIZE 4
+#define KV_RECORD_SIZE(len) (4 + (len) + 2)
+#define KV_END 0xFF // Key byte after the last record
+#define KV_NONE 0   // No record for this key (address 0 is always a bank header)
+
+#define KV_COMPACT_IDLE 0
+#define KV_COMPACT_ERASE 1
+#define KV_COMPACT_COPY 2
+
+_Static_assert(KV_KEYS < KV_END, "KV_END must not be a valid key");
+_Static_assert(KV_HEADER_SIZE + (KV_KEYS + 1) * KV_RECORD_SIZE(KV_MAX_LEN) + 1 <= KV_BANK_SIZE, "Bank too small to compact all keys");
+_Static_assert(KV_RECORD_SIZE(KV_MAX_LEN) + 1 <= EEPROM_QUEUE_SIZE, "EEPROM queue too small for one record");
+
+// Newest value of every key, kvGet() and kvCompact() copy from here and never wait for the EEPROM
 typedef struct {
-	uint32_t timeout;           // Timer timeout in ticks
-	uint32_t last_tick;         // When the timer was last triggered
-	void (*callback)(void);     // Function to call when the timer expires
-	uint8_t active;             // Timer active flag (1 = active, 0 = inactive)
-} VirtualTimer;
+	uint16_t seq;
+	uint8_t len;                // 0 = no value
+	uint8_t data[KV_MAX_LEN];
+} KvValue;
+
+uint16_t kv_index[KV_KEYS];     // Address of the newest record of every key, built once at boot
+KvValue kv_values[KV_KEYS];
+volatile uint8_t kv_written = 1; // Set by EE_READY_vect once the last queued record or header is in the EEPROM
+uint8_t kv_bank = 0;            // Active bank (0 or 1)
+uint16_t kv_generation = 0;     // Generation of the active bank
+uint16_t kv_end = 0;            // Next free address in the active bank
+uint16_t kv_seq = 0;            // Sequence number of the next record
+uint16_t kv_dirty_end = 0;      // Bytes of the active bank before this address may not be erased
+uint8_t kv_compacting = 0;      // KV_COMPACT_...
+uint8_t kv_copy_key = 0;        // Next key to copy
+uint16_t kv_copy_end = 0;       // Next address to erase, then next free address in the other bank
+uint16_t kv_copy_index[KV_KEYS];
+uint16_t kv_compactions = 0;
+uint16_t kv_scan_bytes = 0;     // EEPROM reads done by kvInit()
+uint32_t kv_scan_us = 0;        // Time kvInit() took
+
+uint16_t kvBankStart(uint8_t bank) {
+	return bank ? KV_BANK_SIZE : 0;
+}
 
-// Array of virtual timers
-VirtualTimer timers[MAX_TIMERS];
+// Queue the header of an erased bank, the bank is valid from then on
+void kvQueueHeader(uint16_t bank_start, uint16_t generation) {
+	uint8_t header[KV_HEADER_SIZE] = { generation & 0xFF, generation >> 8, ~generation & 0xFF, ~generation >> 8 };
+	EEPROM_writeAsync(bank_start, header, KV_HEADER_SIZE, EEPROM_MODE_WRITE, &kv_written);
+}
+
+// CRC of a record starts with the generation of its bank, records of older generations never match
+uint16_t kvCrcStart(uint16_t generation) {
+	return _crc_xmodem_update(_crc_xmodem_update(0, generation & 0xFF), generation >> 8);
+}
+
+// Stored CRC, never 0xFFFF, so CRC bytes that were not written yet never match
+uint16_t kvCrcEnd(uint16_t crc) {
+	return crc == 0xFFFF ? 0 : crc;
+}
+
+// Queue a record at 'addr', the CRC as the last bytes (needs KV_RECORD_SIZE(len) queue entries)
+// 'mode' is EEPROM_MODE_WRITE if the bytes are known to be erased
+void kvQueueRecord(uint16_t addr, uint8_t key, const uint8_t *data, uint8_t len, uint16_t seq, uint16_t generation, uint8_t mode) {
+	uint8_t record[KV_RECORD_SIZE(KV_MAX_LEN)] = { key, len, seq & 0xFF, seq >> 8 };
+	for (uint8_t i = 0; i < len; i++) record[4 + i] = data[i];
+	uint16_t crc = kvCrcStart(generation);
+	for (uint8_t i = 0; i < 4 + len; i++) crc = _crc_xmodem_update(crc, record[i]);
+	crc = kvCrcEnd(crc);
+	record[4 + len] = crc & 0xFF;
+	record[5 + len] = crc >> 8;
+	EEPROM_writeAsync(addr, record, KV_RECORD_SIZE(len), mode, &kv_written);
+}
 
-// Function to declare a timer
-void declareTimer(uint8_t timer_index, uint32_t timeout_us, void (*callback)(void)) {
-	if (timer_index < MAX_TIMERS) {
-		timers[timer_index].timeout = timeout_us/256; // Set the timeout value /265 because of new prescaler and compare value
-		timers[timer_index].callback = callback;
-		timers[timer_index].active = 0; // Timer is inactive by default
+// EEPROM read during the boot scan, counted in kv_scan_bytes
+uint8_t kvScanRead(uint16_t addr) {
+	kv_scan_bytes++;
+	return EEPROM_read(addr);
+}
+
+// Generation of a bank, returns 0 if its header is invalid (never written or interrupted)
+uint8_t kvReadHeader(uint8_t bank, uint16_t *generation) {
+	uint16_t start = kvBankStart(bank);
+	uint16_t gen = kvScanRead(start) | (kvScanRead(start + 1) << 8);
+	uint16_t inv = kvScanRead(start + 2) | (kvScanRead(start + 3) << 8);
+	*generation = gen;
+	return gen == (uint16_t)~inv;
+}
+
+// Check the record at 'addr' in the active bank, reads each of its bytes once
+// Returns its length, 0 if it is the end of the log or damaged, the value is copied into 'data'
+uint8_t kvCheckRecord(uint16_t addr, uint16_t bank_end, uint8_t *key, uint16_t *seq, uint8_t *data) {
+	if (addr + KV_RECORD_SIZE(1) > bank_end) return 0;
+	uint8_t header[4];
+	header[0] = kvScanRead(addr);
+	if (header[0] >= KV_KEYS) return 0; // KV_END or garbage
+	header[1] = kvScanRead(addr + 1);
+	uint8_t len = header[1];
+	if (len == 0 || len > KV_MAX_LEN || addr + KV_RECORD_SIZE(len) > bank_end) return 0;
+	header[2] = kvScanRead(addr + 2);
+	header[3] = kvScanRead(addr + 3);
+	
+	uint16_t crc = kvCrcStart(kv_generation);
+	for (uint8_t i = 0; i < 4; i++) crc = _crc_xmodem_update(crc, header[i]);
+	for (uint8_t i = 0; i < len; i++) {
+		data[i] = kvScanRead(addr + 4 + i);
+		crc = _crc_xmodem_update(crc, data[i]);
 	}
+	uint16_t stored = kvScanRead(addr + 4 + len) | (kvScanRead(addr + 5 + len) << 8);
+	if (kvCrcEnd(crc) != stored) return 0;
+	
+	*key = header[0];
+	*seq = header[2] | (header[3] << 8);
+	return len;
 }
 
-// Function to start or restart a timer
-void startTimer(uint8_t timer_index) {
-	timers[timer_index].last_tick = virtual_timer_ticks; // Set last tick to current time
-	timers[timer_index].active = 1;  // Set timer as active
+// Find the active bank and build the index, reads both headers and every byte of the active
+// bank at most once, so the scan is bounded by 2 * KV_HEADER_SIZE + KV_BANK_SIZE reads
+// Must run with interrupts enabled, micros() measures the scan
+void kvInit() {
+	uint32_t start = micros();
+	kv_scan_bytes = 0;
+	
+	uint16_t gen0, gen1;
+	uint8_t valid0 = kvReadHeader(0, &gen0);
+	uint8_t valid1 = kvReadHeader(1, &gen1);
+	for (uint8_t key = 0; key < KV_KEYS; key++) {
+		kv_index[key] = KV_NONE;
+		kv_values[key].len = 0;
+	}
+	kv_seq = 0;
+	
+	if (!valid0 && !valid1) {
+		// Empty EEPROM: no bank yet, a full bank 1 makes the first kvPut() erase bank 0
+		// and start it with generation 0
+		kv_bank = 1;
+		kv_generation = 0xFFFF;
+		kv_end = kvBankStart(1) + KV_BANK_SIZE;
+		kv_dirty_end = kv_end;
+	} else {
+		// Both valid: a compaction was finished, the newer generation counts
+		kv_bank = valid1 && (!valid0 || (int16_t)(gen1 - gen0) > 0);
+		kv_generation = kv_bank ? gen1 : gen0;
+		
+		uint16_t bank_end = kvBankStart(kv_bank) + KV_BANK_SIZE;
+		uint16_t addr = kvBankStart(kv_bank) + KV_HEADER_SIZE;
+		uint16_t seq;
+		uint8_t key, len;
+		uint8_t data[KV_MAX_LEN];
+		while ((len = kvCheckRecord(addr, bank_end, &key, &seq, data))) {
+			// Later records replace earlier ones
+			kv_index[key] = addr;
+			kv_values[key].seq = seq;
+			kv_values[key].len = len;
+			for (uint8_t i = 0; i < len; i++) kv_values[key].data[i] = data[i];
+			if ((int16_t)(seq + 1 - kv_seq) > 0) kv_seq = seq + 1;
+			addr += KV_RECORD_SIZE(len);
+		}
+		kv_end = addr;
+		
+		// An interrupted kvPut() may have written up to one record and its end marker behind the log
+		kv_dirty_end = kv_end + KV_RECORD_SIZE(KV_MAX_LEN) + 1;
+		if (kv_dirty_end > bank_end) kv_dirty_end = bank_end;
+	}
+	kv_compacting = KV_COMPACT_IDLE;
+	kv_scan_us = micros() - start;
 }
 
-// Function to cancel (stop) a timer
-void cancelTimer(uint8_t timer_index) {
-	timers[timer_index].active = 0;  // Deactivate the timer
+// Copy the value of 'key' into 'data' (at most 'max_len' bytes)
+// Returns the length of the value, 0 if the key has none
+uint8_t kvGet(uint8_t key, void *data, uint8_t max_len) {
+	if (key >= KV_KEYS) return 0;
+	uint8_t len = kv_values[key].len;
+	for (uint8_t i = 0; i < len && i < max_len; i++) {
+		((uint8_t *)data)[i] = kv_values[key].data[i];
+	}
+	return len;
+}
+
+// Erase the other bank and copy the newest records into it, as many operations as the EEPROM queue takes
+// Returns 1 once the other bank is complete and active, 0 if it has to be called again
+uint8_t kvCompact() {
+	uint16_t target = kvBankStart(!kv_bank);
+	if (kv_compacting == KV_COMPACT_IDLE) {
+		kv_compacting = KV_COMPACT_ERASE;
+		kv_copy_end = target;
+	}
+	
+	// Header first, the bank is invalid from then on. Bytes that are already erased are skipped by EE_READY_vect.
+	if (kv_compacting == KV_COMPACT_ERASE) {
+		for (; kv_copy_end < target + KV_BANK_SIZE; kv_copy_end++) {
+			if (!EEPROM_queue(kv_copy_end, 0xFF, EEPROM_MODE_ERASE, 0)) return 0;
+		}
+		kv_compacting = KV_COMPACT_COPY;
+		kv_copy_key = 0;
+		kv_copy_end = target + KV_HEADER_SIZE;
+	}
+	
+	for (; kv_copy_key < KV_KEYS; kv_copy_key++) {
+		uint16_t addr = kv_index[kv_copy_key];
+		kv_copy_index[kv_copy_key] = KV_NONE;
+		if (addr == KV_NONE) continue;
+		
+		KvValue *value = &kv_values[kv_copy_key];
+		if (EEPROM_queueFree() < KV_RECORD_SIZE(value->len)) return 0; // Continue with this key next time
+		
+		kvQueueRecord(kv_copy_end, kv_copy_key, value->data, value->len, value->seq, kv_generation + 1, EEPROM_MODE_WRITE);
+		kv_copy_index[kv_copy_key] = kv_copy_end;
+		kv_copy_end += KV_RECORD_SIZE(value->len);
+	}
+	
+	// End marker and the header last, the header switches the banks
+	if (EEPROM_queueFree() < 1 + KV_HEADER_SIZE) return 0;
+	EEPROM_queue(kv_copy_end, KV_END, EEPROM_MODE_WRITE, 0);
+	kvQueueHeader(target, kv_generation + 1);
+	
+	kv_bank = !kv_bank;
+	kv_generation++;
+	kv_end = kv_copy_end;
+	kv_dirty_end = target;
+	for (uint8_t key = 0; key < KV_KEYS; key++) kv_index[key] = kv_copy_index[key];
+	kv_compacting = KV_COMPACT_IDLE;
+	kv_compactions++;
+	return 1;
+}
+
+// Store 'len' bytes (1 to KV_MAX_LEN) as the new value of 'key'
+// Returns 0 if the EEPROM queue is too full or the bank is being compacted, call again later then
+uint8_t kvPut(uint8_t key, const void *data, uint8_t len) {
+	if (key >= KV_KEYS || len == 0 || len > KV_MAX_LEN) return 0;
+	
+	uint16_t bank_end = kvBankStart(kv_bank) + KV_BANK_SIZE;
+	if (kv_compacting || kv_end + KV_RECORD_SIZE(len) > bank_end) {
+		if (!kvCompact()) return 0;
+		bank_end = kvBankStart(kv_bank) + KV_BANK_SIZE;
+	}
+	if (EEPROM_queueFree() < KV_RECORD_SIZE(len) + 1) return 0;
+	
+	// End marker behind the new record first, a damaged record ends the log as well
+	// Erased bytes only need the write, leftovers of an interrupted kvPut() have to be erased again
+	uint8_t mode = kv_end < kv_dirty_end ? EEPROM_MODE_ERASE_WRITE : EEPROM_MODE_WRITE;
+	uint16_t addr = kv_end;
+	kv_end += KV_RECORD_SIZE(len);
+	if (kv_end < bank_end) EEPROM_queue(kv_end, KV_END, mode, 0);
+	kvQueueRecord(addr, key, data, len, kv_seq, kv_generation, mode);
+	kv_index[key] = addr;
+	kv_values[key].seq = kv_seq++;
+	kv_values[key].len = len;
+	for (uint8_t i = 0; i < len; i++) kv_values[key].data[i] = ((const uint8_t *)data)[i];
+	return 1;
+}
+
+// Number of keys with a value
+uint8_t kvCount() {
+	uint8_t count = 0;
+	for (uint8_t key = 0; key < KV_KEYS; key++) {
+		if (kv_index[key] != KV_NONE) count++;
+	}
+	return count;
 }
 
 
 
 // ######################################################################################
-// RINGBUFFER FUNCTIONS
+// SETTINGS
 // ######################################################################################
 
+// Persistent settings, kept in RAM and written to the key-value store in the background
+// X(name, type, default) - the position in the list is the key in the store
+#define SETTINGS(X) \
+	X(start_time, uint8_t, STARTTIME_COUNTER) /* Starttime, flipped for the LED counter */
+
+#define SETTING_FIELD(name, type, default) type name;
+typedef struct { SETTINGS(SETTING_FIELD) } Settings;
+
+#define SETTING_BIT(name, type, default) SETTING_##name,
+enum { SETTINGS(SETTING_BIT) SETTING_COUNT };
+_Static_assert(SETTING_COUNT <= 8 && SETTING_COUNT <= KV_KEYS, "settings_dirty has one bit per setting");
+
+#define SETTING_SIZE_CHECK(name, type, default) _Static_assert(sizeof(type) <= KV_MAX_LEN, #name " is too large for the key-value store");
+SETTINGS(SETTING_SIZE_CHECK)
+
+Settings settings;        // RAM shadow, all reads are served from here
+Settings settings_stored; // Values in the EEPROM (or already queued for it)
+uint8_t settings_dirty = 0;     // One bit per setting changed since the last flush
+uint8_t settings_flush_due = 0; // Set by the idle timeout or settingsCommit()
+
+// Change a setting in RAM only, every change restarts the idle timeout
+#define settingSet(name, value) do { \
+	settings.name = (value); \
+	settings_dirty |= (1 << SETTING_##name); \
+	timer_start(TIMER_SETTINGS_FLUSH); \
+} while (0)
+
+// Load all settings once at boot, missing or damaged ones get their default
+#define SETTING_LOAD(name, type, default) \
+	if (kvGet(SETTING_##name, &settings.name, sizeof(type)) != sizeof(type)) settings.name = (default); \
+	settings_stored.name = settings.name;
+void settingsLoad() {
+	SETTINGS(SETTING_LOAD)
+	settings_dirty = 0;
+}
+
+// Write the changed settings now instead of waiting for the idle timeout
+void settingsCommit() {
+	timer_cancel(TIMER_SETTINGS_FLUSH);
+	settings_flush_due = 1;
+}
+
+// Queue the EEPROM writes of all changed settings in one go
+// A setting that was changed back to its stored value is dropped without an EEPROM write
+// Returns 0 if a write did not fit into the EEPROM queue, that setting stays dirty
+#define SETTING_FLUSH(name, type, default) \
+	if ((settings_dirty & (1 << SETTING_##name)) && (settings.name == settings_stored.name || kvPut(SETTING_##name, &settings.name, sizeof(type)))) { \
+		settings_stored.name = settings.name; \
+		settings_dirty &= ~(1 << SETTING_##name); \
+	}
+uint8_t settingsFlush() {
+	SETTINGS(SETTING_FLUSH)
+	return settings_dirty == 0;
+}
+
+
+// ######################################################################################
+// RINGBUFFERS (type and functions in Common/ringbuffer.h)
+// ######################################################################################
+
+RINGBUFFER(rx_buffer, RINGBUFFER_SIZE); // Filled by USART_RX_vect, read by the main loop
+RINGBUFFER(tx_buffer, TX_BUFFER_SIZE);  // Filled by the main loop, drained by USART_UDRE_vect
+
+
+
+// ######################################################################################
+// PROFILING
+// ######################################################################################
+
+// Runtime of the interrupt handlers, measured with the free running Timer1 (1 count = 4 us = 64 cycles)
+// Only the ISR bodies are measured, the register save/restore of the compiler is not included.
+// The resolution is one count, so most handlers measure 0 or 1 counts per call and only the
+// totals over many calls are meaningful. The values are reported in counts, not in CPU cycles.
+
+enum { PROFILE_TIMER1_COMPA, PROFILE_USART_RX, PROFILE_USART_UDRE, PROFILE_EE_READY, PROFILE_CTS, PROFILE_COUNT };
+
+const char profile_name_timer1_compa[] PROGMEM = "TIMER1_COMPA";
+const char profile_name_usart_rx[] PROGMEM = "USART_RX";
+const char profile_name_usart_udre[] PROGMEM = "USART_UDRE";
+const char profile_name_ee_ready[] PROGMEM = "EE_READY";
+const char profile_name_cts[] PROGMEM = "CTS (PCINT)";
+const char * const profile_names[PROFILE_COUNT] PROGMEM = { profile_name_timer1_compa, profile_name_usart_rx, profile_name_usart_udre, profile_name_ee_ready, profile_name_cts };
+
 typedef struct {
-	uint8_t buffer[RINGBUFFER_SIZE];
-	uint8_t head; // Pointer to the next write position in the buffer
-	uint8_t tail; // Pointer to the next read position in the buffer
-	uint8_t size; // Tracks the number of elements currently in the buffer
-} RingBuffer;
+	uint32_t count;             // Number of calls
+	uint32_t total;             // Sum of all runtimes in Timer1 counts
+	uint16_t max;               // Longest runtime in Timer1 counts
+} IsrProfile;
+
+volatile IsrProfile isr_profile[PROFILE_COUNT];
+
+// Timer1 counts since 'start'
+uint16_t timer1CountsSince(uint16_t start) {
+	uint16_t now = TCNT1;
+#if TIMER_TICKLESS
+	return now - start; // Timer1 runs freely, 16 bit arithmetic handles the overflow
+#else
+	return now >= start ? now - start : now + TIMER_TICK_COUNTS - start; // CTC restarts at TIMER_TICK_COUNTS
+#endif
+}
 
-volatile RingBuffer rb;
+// Use at the very beginning and end of an ISR body
+#define ISR_PROFILE_ENTER() uint16_t isr_profile_start = TCNT1
+#define ISR_PROFILE_EXIT(id) isrProfileRecord(id, isr_profile_start)
 
-// Initialize an empty ring buffer
-void ringBufferInit() {
-	rb.head = rb.tail = 0;
-	rb.size = 0;
+// Interrupts are disabled inside the ISR, so no atomic block is needed
+void isrProfileRecord(uint8_t id, uint16_t start) {
+	uint16_t duration = timer1CountsSince(start);
+	isr_profile[id].count++;
+	isr_profile[id].total += duration;
+	if (duration > isr_profile[id].max) isr_profile[id].max = duration;
 }
 
-// Write data to the buffer
-void ringBufferWrite(uint8_t data) {
-	rb.buffer[rb.head] = data; // Write the data to the buffer at the head position
-	rb.head = (rb.head + 1) % RINGBUFFER_SIZE; // Move the head pointer to the next position, wrapping around if needed
-	rb.size++; // Increment the size of the buffer
+void resetIsrProfile() {
+	for (uint8_t i = 0; i < PROFILE_COUNT; i++) {
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			isr_profile[i].count = 0;
+			isr_profile[i].total = 0;
+			isr_profile[i].max = 0;
+		}
+	}
 }
 
-// Read data from the buffer
-uint8_t ringBufferRead() {
-	uint8_t data = 0;
-	if (rb.size > 0) { // Check if the buffer is not empty
-		data = rb.buffer[rb.tail]; // Read the data from the buffer at the tail position
-		rb.tail = (rb.tail + 1) % RINGBUFFER_SIZE; // Move the tail pointer to the next position, wrapping around if needed
-		rb.size--; // Decrement the size of the buffer
+
+
+// ######################################################################################
+// IDLE
+// ######################################################################################
+
+uint64_t load_since = 0; // ticks64() at the last reset of the load counters
+uint32_t idle_loops = 0; // Main loop passes without work
+uint16_t idle_loop_counts = 0; // Timer1 counts for IDLE_CALIBRATION_LOOPS idle passes, see idleCalibrate()
+
+#if IDLE_SLEEP
+uint64_t idle_sleep_us = 0; // Time spent asleep in us
+
+// Put the CPU into idle sleep until the next interrupt, as long as nothing is waiting for it
+// Every state change that can end the sleep comes from an interrupt, which also wakes the CPU
+void idleSleep() {
+	idle_loops++;
+	cli();
+	// Check again with interrupts disabled, an interrupt right before sleep_cpu() would be lost otherwise
+	if (timer_event_head != timer_event_tail || ringBufferCount(&rx_buffer) > 0) {
+		sei();
+		return;
 	}
-	return data;
+	
+	uint32_t t0 = micros();
+	
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	sleep_enable();
+	sei(); // The instruction after sei is always executed, so no interrupt can sneak in before the sleep
+	sleep_cpu();
+	sleep_disable();
+	
+	idle_sleep_us += micros() - t0; // Includes the interrupt that woke us up
+}
+#else
+// Count one main loop pass without work
+void idleSleep() {
+	idle_loops++;
+}
+#endif
+
+// Time spent idle since the last reset in us
+// Idle passes * calibrated time per pass, in sleep mode plus the time asleep
+uint64_t idleTimeUs() {
+	uint64_t idle_us = (uint64_t)idle_loops * idle_loop_counts * 4 / IDLE_CALIBRATION_LOOPS;
+#if IDLE_SLEEP
+	idle_us += idle_sleep_us;
+#endif
+	return idle_us;
+}
+
+void resetIdleStats() {
+	idle_loops = 0;
+#if IDLE_SLEEP
+	idle_sleep_us = 0;
+#endif
+	load_since = ticks64();
+}
+
+// Number of interrupts so far, every handler is counted by the profiler
+uint32_t isrCalls() {
+	uint32_t calls = 0;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		for (uint8_t i = 0; i < PROFILE_COUNT; i++) calls += isr_profile[i].count;
+	}
+	return calls;
 }
 
 
@@ -235,38 +1236,271 @@ uint8_t ringBufferRead() {
 // UART FUNCTIONS
 // ######################################################################################
 
+// Error and overflow counters, the RX fields are written by USART_RX_vect
+typedef struct {
+	uint16_t overrun;   // Hardware overrun (DOR0), bytes lost before the interrupt read UDR0
+	uint16_t framing;   // Framing errors (FE0), byte discarded
+	uint16_t parity;    // Parity errors (UPE0), byte discarded
+	uint16_t rx_drop;   // Bytes lost because the receive buffer was full
+	uint16_t tx_drop;   // Bytes lost because the transmit buffer was full
+	uint8_t rx_max;     // Highest fill level of the receive buffer
+	uint8_t tx_max;     // Highest fill level of the transmit buffer
+	uint8_t tx_queue_max; // Highest number of entries in the transmit queue
+	uint64_t xoff_us;   // Time the other side was stopped (XOFF or RTS)
+} UartStats;
+
+volatile UartStats uart_stats;
+volatile uint32_t xoff_since = 0; // micros() when the other side was stopped
+
+// Transmit queue
+// Every entry describes a piece of output that USART_UDRE_vect sends from where it is:
+// flash strings and RAM buffers are not copied, numbers are formatted into the entry itself.
+// Only single chars and copied data go through tx_buffer. A whole reply is queued with a few
+// entries and the main loop continues while it is sent.
+#define TX_RING 0    // 'len' bytes from tx_buffer
+#define TX_RAM 1     // 'len' bytes at 'ptr' in RAM, must stay unchanged until sent
+#define TX_PROGMEM 2 // 'len' bytes at 'ptr' in flash
+#define TX_PSTR 3    // Flash string at 'ptr' up to its '\0'
+#define TX_INLINE 4  // 'len' chars in 'data' from 'pos' on
+
+#if TX_OVERFLOW_POLICY == OVERFLOW_DROP_OLDEST
+#error "OVERFLOW_DROP_OLDEST is not possible for the transmit queue, entries are sent from their source"
+#endif
 
+typedef struct {
+	uint8_t type;
+	uint8_t pos;   // Next char in 'data' (TX_INLINE)
+	uint16_t len;  // Bytes left (not used by TX_PSTR)
+	union {
+		const uint8_t *ptr;
+		char data[TX_INLINE_SIZE];
+	};
+} TxEntry;
+
+_Static_assert((TX_QUEUE_SIZE & (TX_QUEUE_SIZE - 1)) == 0 && TX_QUEUE_SIZE <= 128, "TX_QUEUE_SIZE must be a power of two <= 128");
+
+volatile TxEntry tx_queue[TX_QUEUE_SIZE];
+volatile uint8_t tx_queue_head = 0; // Written by the main loop only
+volatile uint8_t tx_queue_tail = 0; // Written by USART_UDRE_vect only
+
+uint8_t txQueueCount() {
+	return (uint8_t)(tx_queue_head - tx_queue_tail);
+}
+
+uint8_t txQueueFree() {
+	return TX_QUEUE_SIZE - txQueueCount();
+}
+
+// Free entry at the head of the queue, filled in by the caller and handed over with txQueueCommit()
+// A full queue is handled according to TX_OVERFLOW_POLICY: wait (and run expired timers) or return 0
+volatile TxEntry *txQueueSlot() {
+#if TX_OVERFLOW_POLICY == OVERFLOW_BLOCK
+	while (txQueueCount() == TX_QUEUE_SIZE) dispatchTimers();
+#else
+	if (txQueueCount() == TX_QUEUE_SIZE) return 0;
+#endif
+	return &tx_queue[tx_queue_head & (TX_QUEUE_SIZE - 1)];
+}
+
+// Hand the entry from txQueueSlot() over to USART_UDRE_vect
+void txQueueCommit() {
+	tx_queue_head++;
+	uint8_t count = txQueueCount();
+	if (count > uart_stats.tx_queue_max) uart_stats.tx_queue_max = count;
+	UCSR0B |= (1 << UDRIE0); // UDRE interrupt sends it
+}
+
+// Queue 'len' bytes that are sent straight from RAM (TX_RAM) or flash (TX_PROGMEM)
+void USART_sendRef(uint8_t type, const void *ptr, uint16_t len) {
+	if (len == 0) return;
+	volatile TxEntry *e = txQueueSlot();
+	if (!e) {
+		uart_stats.tx_drop += len;
+		return;
+	}
+	e->type = type;
+	e->ptr = ptr;
+	e->len = len;
+	txQueueCommit();
+}
+
+// Queue up to TX_INLINE_SIZE chars, they are copied into the entry
+void USART_sendInline(const char *data, uint8_t len) {
+	if (len == 0) return; // USART_UDRE_vect would count len down from 0
+	volatile TxEntry *e = txQueueSlot();
+	if (!e) {
+		uart_stats.tx_drop += len;
+		return;
+	}
+	e->type = TX_INLINE;
+	e->pos = 0;
+	e->len = len;
+	for (uint8_t i = 0; i < len; i++) e->data[i] = data[i];
+	txQueueCommit();
+}
+
+// Copy up to 'len' bytes into the transmit buffer without waiting, returns the number of bytes queued
+// Consecutive writes share one queue entry as long as it has not been sent completely
+uint8_t USART_write(const uint8_t *data, uint8_t len) {
+	uint8_t head = tx_queue_head;
+	volatile TxEntry *last = &tx_queue[(head - 1) & (TX_QUEUE_SIZE - 1)];
+	if (txQueueCount() == TX_QUEUE_SIZE && last->type != TX_RING) return 0; // No entry for the bytes
+	
+	len = ringBufferWriteN(&tx_buffer, data, len);
+	if (len == 0) return 0;
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		if (tx_queue_tail != head && last->type == TX_RING) {
+			last->len += len; // Still queued, the UDRE interrupt sends the new bytes with it
+			UCSR0B |= (1 << UDRIE0);
+		} else {
+			// The queue had room above, or the last entry was finished and freed its slot meanwhile
+			volatile TxEntry *e = &tx_queue[head & (TX_QUEUE_SIZE - 1)];
+			e->type = TX_RING;
+			e->len = len;
+			txQueueCommit();
+		}
+	}
+	
+	uint8_t count = ringBufferCount(&tx_buffer);
+	if (count > uart_stats.tx_max) uart_stats.tx_max = count;
+	return len;
+}
+
+// Queue all bytes, waits (and runs expired timers) while the transmit buffer is full
+// Must not be used inside an interrupt, the buffer would never drain
+void USART_writeBlocking(const uint8_t *data, uint16_t len) {
+	while (len > 0) {
+		uint8_t n = USART_write(data, len > 255 ? 255 : len);
+		data += n;
+		len -= n;
+		if (len > 0) dispatchTimers();
+	}
+}
+
+// Send XON/XOFF before everything in the transmit buffer, never waits (safe inside an interrupt)
+void USART_TransmitPriority(unsigned char data) {
+	tx_priority = data;
+	UCSR0B |= (1 << UDRIE0);
+}
+
+// Queue all bytes, a full transmit buffer is handled according to TX_OVERFLOW_POLICY
+void USART_send(const uint8_t *data, uint16_t len) {
+#if TX_OVERFLOW_POLICY == OVERFLOW_BLOCK
+	USART_writeBlocking(data, len);
+#else
+	while (len > 0) {
+		uint8_t n = USART_write(data, len > 255 ? 255 : len);
+		data += n;
+		len -= n;
+		if (n == 0) break;
+	}
+	uart_stats.tx_drop += len;
+#endif
+}
+
+// Stop the other side, the receive buffer is nearly full (safe inside an interrupt)
+void flowStop() {
+#if FLOW_CONTROL == FLOW_XONXOFF
+	USART_TransmitPriority(XOFF);
+#elif FLOW_CONTROL == FLOW_RTSCTS
+	RTS_PORT |= (1 << RTS_PIN);
+#endif
+	flowcontrol = 0;
+	xoff_since = micros();
+}
+
+// Let the other side continue
+// USART_RX_vect may call flowStop() as soon as flowcontrol is 1, so the stopped time is
+// added and the other side released without interruption
+void flowResume() {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		uart_stats.xoff_us += micros() - xoff_since;
+#if FLOW_CONTROL == FLOW_XONXOFF
+		USART_TransmitPriority(XON);
+#elif FLOW_CONTROL == FLOW_RTSCTS
+		RTS_PORT &= ~(1 << RTS_PIN);
+#endif
+		flowcontrol = 1;
+	}
+}
+
+// 1 if the other side cannot receive at the moment, checked before every byte
+uint8_t flowTxStopped() {
+#if FLOW_CONTROL == FLOW_XONXOFF
+	return tx_xoff;
+#elif FLOW_CONTROL == FLOW_RTSCTS
+	return (CTS_PINS & (1 << CTS_PIN)) != 0;
+#else
+	return 0;
+#endif
+}
+
+void flowInit() {
+#if FLOW_CONTROL == FLOW_XONXOFF
+	USART_TransmitPriority(XON);
+#elif FLOW_CONTROL == FLOW_RTSCTS
+	RTS_DDR |= (1 << RTS_PIN);
+	RTS_PORT &= ~(1 << RTS_PIN);   // Ready to receive
+	CTS_DDR &= ~(1 << CTS_PIN);
+	CTS_PORT |= (1 << CTS_PIN);    // Pull-up, an unconnected CTS stops the transmission
+	CTS_PCMSK |= (1 << CTS_PCINT); // CTS_vect restarts the transmission
+	PCICR |= (1 << CTS_PCIE);
+#endif
+	flowcontrol = 1;
+}
 
 // Send single char over UART
 void USART_Transmit(unsigned char data){
-	while(!(UCSR0A & (1<<UDRE0))) ;
-	UDR0 = data;
+	USART_send(&data, 1);
+}
+
+// Check if there is a received char in the Ringbuffer
+uint8_t USART_available(){
+	return ringBufferCount(&rx_buffer) > 0;
 }
 
 // Read received char from Ringbuffer
 unsigned char USART_Receive(){
-	while(rb.size == 0); // Wait until there is something in the Buffer
-	uint8_t data = ringBufferRead();
-	if(rb.size <= RINGBUFFER_LOW_LIMIT && flowcontrol == 0) {
-		USART_Transmit(XON);
-		flowcontrol = 1;
+	while(ringBufferCount(&rx_buffer) == 0) dispatchTimers(); // Run expired timers until there is something in the Buffer
+	uint8_t data;
+#if RX_OVERFLOW_POLICY == OVERFLOW_DROP_OLDEST
+	// USART_RX_vect may move the tail as well, so the read must not be interrupted
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		data = ringBufferRead(&rx_buffer);
+	}
+#else
+	data = ringBufferRead(&rx_buffer);
+#endif
+#if RX_OVERFLOW_POLICY == OVERFLOW_BLOCK
+	UCSR0B |= (1 << RXCIE0); // There is room again, fetch the byte waiting in UDR0
+#endif
+	if(ringBufferCount(&rx_buffer) <= RINGBUFFER_LOW_LIMIT && flowcontrol == 0) {
+		flowResume();
 	}
 	return data;
 }
 
 // Function to send String
+// Sent straight from RAM, the string must stay unchanged until it is out (e.g. a literal)
 void USART_puts(const char *str) {
-	while(*str) {
-		USART_Transmit(*str++);
-	}
+	uint16_t len = 0;
+	while(str[len]) len++;
+	USART_sendRef(TX_RAM, str, len);
 }
 
 //Function to send String from PROGMEM
+// Only queues the address, the UDRE interrupt reads the chars from flash
 void USART_puts_P(const char *str) {
-	char c;
-	while((c = pgm_read_byte(str++))) {
-		USART_Transmit(c);
+	if (pgm_read_byte(str) == '\0') return;
+	volatile TxEntry *e = txQueueSlot();
+	if (!e) {
+		uart_stats.tx_drop += strlen_P(str);
+		return;
 	}
+	e->type = TX_PSTR;
+	e->ptr = (const uint8_t *)str;
+	txQueueCommit();
 }
 
 // Show start menu
@@ -274,75 +1508,532 @@ void showMenu() {
 	USART_puts_P(menu_str);
 }
 
-// Reads the Starttime from User. 
-uint8_t USART_readNumber() {
+// Powers of ten for the decimal output, 10^9 down to 10^1
+const uint32_t pow10_table[9] PROGMEM = { 1000000000, 100000000, 10000000, 1000000, 100000, 10000, 1000, 100, 10 };
+
+// Write 'val' in decimal to 'buf', at least 'min_digits' digits (leading zeros) and a '.' before the last 'decimals' digits
+// Each digit is found by subtracting its power of ten, the AVR has no divider and
+// a 32 bit division by 10 through libgcc costs several hundred cycles per digit
+// Returns the number of chars (max. 11)
+uint8_t formatDecimal(char *buf, uint32_t val, uint8_t min_digits, uint8_t decimals) {
+	uint8_t len = 0;
+	uint8_t started = 0;
+	for (uint8_t i = 0; i < 9; i++) {
+		uint8_t pos = 9 - i; // Digit position, 0 = ones
+		uint32_t p = pgm_read_dword(&pow10_table[i]);
+		char digit = '0';
+		while (val >= p) {
+			val -= p;
+			digit++;
+		}
+		if (digit != '0' || pos < min_digits || pos < decimals + 1) started = 1;
+		if (started) {
+			buf[len++] = digit;
+			if (pos == decimals) buf[len++] = '.';
+		}
+	}
+	buf[len++] = '0' + val;
+	return len;
+}
+
+// Send 'val' in decimal, see formatDecimal()
+// The chars are queued in one transmit entry, nothing waits for the UART
+void USART_putDecimal(uint32_t val, uint8_t min_digits, uint8_t decimals) {
+	char buf[TX_INLINE_SIZE];
+	USART_sendInline(buf, formatDecimal(buf, val, min_digits, decimals));
+}
 
-	uint8_t val = USART_Receive();
+// Send unsigned number as decimal string
+void USART_putNumber(uint32_t val) {
+	USART_putDecimal(val, 1, 0);
+}
 
-	if (val >= '0' && val <= '7') {
-		// Accept only digits from 0 to 7
-		USART_Transmit(val);
-		return flip_3bit_ascii_for_counter(val);
+// Send a fixed point number, e.g. 3300 mV with decimals = 3 -> "3.300"
+void USART_putFixed(int32_t val, uint8_t decimals) {
+	char buf[TX_INLINE_SIZE];
+	uint8_t len = 0;
+	uint32_t magnitude = val;
+	if (val < 0) {
+		buf[len++] = '-';
+		magnitude = 0 - (uint32_t)val;
 	}
-	
-	if (val == '\r' || val == '\n') {
-		// End of entry
+	len += formatDecimal(buf + len, magnitude, 1, decimals);
+	USART_sendInline(buf, len);
+}
+
+// Send signed number as decimal string
+void USART_putSigned(int32_t val) {
+	USART_putFixed(val, 0);
+}
+
+// Send the lowest 'digits' nibbles of 'val' as hex (without prefix, max. 8)
+void USART_putHex(uint32_t val, uint8_t digits) {
+	char buf[8];
+	uint8_t len = 0;
+	while (digits-- > 0) {
+		uint8_t nibble = (val >> (4 * digits)) & 0x0F;
+		buf[len++] = nibble < 10 ? '0' + nibble : 'A' - 10 + nibble;
+	}
+	USART_sendInline(buf, len);
+}
+
+// Reports are sent in parts of at most REPORT_PART_ENTRIES transmit queue entries, the shell
+// task queues the next part once there is room, see shellTask(). The reply of a command
+// without a report and the last part of a report together with the prompt stay below it as well.
+// A report function sends part 'part' and returns 0 if it was the last one
+#define REPORT_PART_ENTRIES 12
+_Static_assert(REPORT_PART_ENTRIES <= TX_QUEUE_SIZE, "A report part must fit into the transmit queue");
+
+// Show lateness statistics of all timers, one timer per part
+uint8_t reportTimerStats(uint8_t part) {
+	if (part == MAX_TIMERS) {
+		USART_Transmit('\r');
+		USART_Transmit('\n');
+		return 0;
+	}
+	uint8_t i = part;
+	if (timers[i].generation & 1) { // Slot in use
+		uint32_t runs, late_sum, late_max;
+		uint16_t missed;
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			runs = timers[i].runs;
+			late_sum = timers[i].late_sum;
+			late_max = timers[i].late_max;
+			missed = timers[i].missed;
+		}
+		
+		USART_puts_P(stats_timer_msg);
+		USART_putNumber(i);
+		USART_puts_P(stats_runs_msg);
+		USART_putNumber(runs);
+		USART_puts_P(stats_mean_msg);
+		USART_putNumber(runs ? late_sum / runs : 0);
+		USART_puts_P(stats_max_msg);
+		USART_putNumber(late_max);
+		USART_puts_P(stats_missed_msg);
+		USART_putNumber(missed);
+	}
+	return 1;
+}
+
+// Send a permille value as percent with one decimal place
+void USART_putPermille(uint32_t val) {
+	USART_putFixed(val, 1);
+	USART_Transmit('%');
+}
+
+uint64_t report_total_us; // Measured time of the load report, taken with its first part
+
+// Show CPU utilisation, then the runtime of one interrupt handler per part
+uint8_t reportLoad(uint8_t part) {
+	if (part == 0) {
+		uint64_t idle_us = idleTimeUs();
+		report_total_us = (ticks64() - load_since) * 4;
+		if (idle_us > report_total_us) idle_us = report_total_us;
+		
+		USART_puts_P(load_time_msg);
+		USART_putNumber(report_total_us / 1000);
+		USART_puts_P(load_idle_msg);
+		USART_putNumber(idle_us / 1000);
+		USART_puts_P(load_percent_msg);
+		USART_putPermille(report_total_us ? (report_total_us - idle_us) * 1000 / report_total_us : 0);
+		USART_puts_P(load_unit_msg);
+		return 1;
+	}
+	if (part == PROFILE_COUNT + 1) {
 		USART_Transmit('\r');
 		USART_Transmit('\n');
-		val = '0';
-		return flip_3bit_ascii_for_counter(val);
+		return 0;
 	}
 	
-	// Ignore characters outside '0'-'7'
-	USART_puts_P(invalid_time_msg);
-	USART_puts_P(set_time_msg);
-	USART_readNumber();
-	return 0;
+	uint8_t i = part - 1;
+	uint32_t count, total;
+	uint16_t max;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		count = isr_profile[i].count;
+		total = isr_profile[i].total;
+		max = isr_profile[i].max;
+	}
+	
+	// Mean and max in Timer1 counts (4 us), the mean with two decimal places
+	USART_puts_P(load_isr_msg);
+	USART_puts_P((const char *)pgm_read_ptr(&profile_names[i]));
+	USART_puts_P(load_count_msg);
+	USART_putNumber(count);
+	USART_puts_P(load_mean_msg);
+	USART_putFixed(count ? (uint64_t)total * 100 / count : 0, 2);
+	USART_puts_P(load_max_msg);
+	USART_putNumber(max);
+	USART_puts_P(load_share_msg);
+	USART_putPermille(report_total_us ? (uint64_t)total * 4 * 1000 / report_total_us : 0);
+	return 1;
 }
 
-// Process menu
-void processCommand(uint8_t cmd) {
-	switch (cmd) {
-		case 'a': // Start
-			led_counter = eeprom_read_byte(&start_time); // Reset Stoppwatch to Starttime
-			startTimer(0); // Start LED counter timer
-			stopwatch_active = 1;
-			USART_puts_P(start_msg);
-			break;
-		case 'b': // Stop
-			cancelTimer(0); // Stop LED counter timer
-			stopwatch_active = 0;
-			char b_buffer_1[4]; char b_buffer_2[4];
-			USART_puts_P(stop_msg_1);
-			USART_puts(itoa(stopwatch_counter, b_buffer_1, 10));
-			USART_puts_P(stop_msg_2);
-			USART_puts(itoa(flip_int_first_3bit(led_counter), b_buffer_2, 10));
-			USART_Transmit('\r');
-			USART_Transmit('\n');
-			stopwatch_counter = 0;
-			break;
-		case 'c': { // Set Starttime
-			USART_puts_P(set_time_msg);
-			led_counter = (uint8_t)USART_readNumber();
-			eeprom_write_byte(&start_time, led_counter); // Write new starttime to EEPROM
-			PORTB = (PORTB & ~(0b00000111)) | led_counter; // Update LEDs
-			break;
+UartStats report_uart; // Copy of uart_stats, taken with the first part of the report
+
+// Show UART errors, dropped bytes and buffer fill levels
+uint8_t reportUartStats(uint8_t part) {
+	UartStats *stats = &report_uart;
+	if (part == 0) {
+		uint8_t xoff;
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			report_uart = uart_stats;
+			xoff = !flowcontrol;
 		}
-		case 'd': // Show current Starttime
-			USART_puts_P(show_time_msg);
-			char d_buffer_1[4];
-			USART_puts(itoa(flip_int_first_3bit(eeprom_read_byte(&start_time)), d_buffer_1, 10));
+		if (xoff) report_uart.xoff_us += micros() - xoff_since; // Still stopped
+	}
+	
+	switch (part) {
+		case 0:
+			USART_puts_P(uart_overrun_msg);
+			USART_putNumber(stats->overrun);
+			USART_puts_P(uart_framing_msg);
+			USART_putNumber(stats->framing);
+			USART_puts_P(uart_parity_msg);
+			USART_putNumber(stats->parity);
+			return 1;
+		case 1:
+			USART_puts_P(uart_rx_drop_msg);
+			USART_putNumber(stats->rx_drop);
+			USART_puts_P(uart_rx_max_msg);
+			USART_putNumber(stats->rx_max);
+			USART_Transmit('/');
+			USART_putNumber(RINGBUFFER_SIZE);
+			USART_puts_P(uart_tx_drop_msg);
+			USART_putNumber(stats->tx_drop);
+			return 1;
+		case 2:
+			USART_puts_P(uart_tx_max_msg);
+			USART_putNumber(stats->tx_max);
+			USART_Transmit('/');
+			USART_putNumber(TX_BUFFER_SIZE);
+			USART_puts_P(uart_tx_queue_msg);
+			USART_putNumber(stats->tx_queue_max);
+			USART_Transmit('/');
+			USART_putNumber(TX_QUEUE_SIZE);
+			return 1;
+		default:
+			USART_puts_P(uart_xoff_msg);
+			USART_putNumber(stats->xoff_us / 1000);
+			USART_Transmit('m');
+			USART_Transmit('s');
 			USART_Transmit('\r');
 			USART_Transmit('\n');
+		return 0;
+	}
+}
+
+void resetUartStats() {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		uart_stats = (UartStats){0};
+		if (!flowcontrol) xoff_since = micros();
+	}
+}
+
+// Current Starttime, from the RAM copy of the settings
+uint8_t getStartTime() {
+	return settings.start_time;
+}
+
+// Set a new Starttime, the EEPROM task writes it once it stays unchanged for SETTINGS_IDLE_US
+void setStartTime(uint8_t val) {
+	led_counter = val;
+	settingSet(start_time, val);
+	PORTB = (PORTB & ~(0b00000111)) | led_counter; // Update LEDs
+}
+
+
+
+// ######################################################################################
+// SHELL
+// ######################################################################################
+
+// Commands are entered as a line: name, optional number, Enter (e.g. "c 5" or "set 5")
+// Every byte is handled as soon as it arrives and the number is built up digit by digit,
+// so the work per byte is constant and does not depend on the line or the typing speed
+
+#define SHELL_NAME_LENGTH 7 // Longest command name
+
+// Argument of a command
+#define SHELL_ARG_NONE 0     // No number allowed
+#define SHELL_ARG_REQUIRED 1 // Number between min and max required
+
+// Parser states
+#define SHELL_NAME 0   // Reading the command name
+#define SHELL_SPACE 1  // Spaces between name and number
+#define SHELL_NUMBER 2 // Reading the number
+#define SHELL_ERROR 3  // Invalid input, ignored up to the end of the line
+
+// Command table entry in flash
+typedef struct {
+	char name[2];                      // Short name, one char
+	char alias[SHELL_NAME_LENGTH + 1]; // Long name
+	void (*handler)(uint32_t arg);     // Gets the number, 0 for commands without one
+	uint8_t arg;                       // SHELL_ARG_NONE or SHELL_ARG_REQUIRED
+	uint32_t min;                      // Allowed range of the number
+	uint32_t max;
+} ShellCommand;
+
+// Line that is being entered, only the parsed parts are kept
+typedef struct {
+	char name[SHELL_NAME_LENGTH + 1];
+	uint8_t name_len;
+	uint8_t spaces;      // Spaces after the name, needed to undo them with backspace
+	uint8_t digits;      // Digits of the number so far
+	uint8_t state;
+	uint8_t error_state; // State before the invalid input, restored if it is deleted again
+	uint8_t error_len;   // Chars since the invalid input
+	uint8_t last;        // Previous char, CR LF only ends one line
+	uint32_t value;
+} Shell;
+
+Shell shell;
+
+uint8_t (*shell_report)(uint8_t part) = 0; // Report that is being sent, see REPORT_PART_ENTRIES
+uint8_t shell_report_part = 0;
+
+// Send a report after the command, shellTask() queues it part by part
+void shellReport(uint8_t (*report)(uint8_t part)) {
+	shell_report = report;
+	shell_report_part = 0;
+}
+
+void cmdStart(uint32_t arg) {
+	led_counter = getStartTime(); // Reset Stoppwatch to Starttime
+	PORTB = (PORTB & ~(0b00000111)) | led_counter; // Update LEDs
+	timer_start(TIMER_LED_COUNTER); // Start LED counter timer
+	stopwatch_active = 1;
+	USART_puts_P(start_msg);
+}
+
+void cmdStop(uint32_t arg) {
+	timer_cancel(TIMER_LED_COUNTER); // Stop LED counter timer
+	stopwatch_active = 0;
+	USART_puts_P(stop_msg_1);
+	USART_putNumber(stopwatch_counter);
+	USART_puts_P(stop_msg_2);
+	USART_putNumber(flip_int_first_3bit(led_counter));
+	USART_Transmit('\r');
+	USART_Transmit('\n');
+	stopwatch_counter = 0;
+}
+
+void cmdSetStartTime(uint32_t arg) {
+	setStartTime(flip_int_first_3bit(arg));
+	USART_puts_P(set_time_msg);
+	USART_putNumber(arg);
+	USART_Transmit('\r');
+	USART_Transmit('\n');
+}
+
+void cmdShowStartTime(uint32_t arg) {
+	USART_puts_P(show_time_msg);
+	USART_putNumber(flip_int_first_3bit(getStartTime()));
+	USART_Transmit('\r');
+	USART_Transmit('\n');
+}
+
+void cmdEeprom(uint32_t arg) {
+	USART_puts_P(eeprom_msg_1);
+	USART_putNumber(arg);
+	USART_puts_P(eeprom_msg_2);
+	USART_putHex(EEPROM_readCurrent(arg), 2);
+	USART_Transmit('\r');
+	USART_Transmit('\n');
+}
+
+void cmdTimerStats(uint32_t arg) {
+	shellReport(reportTimerStats);
+}
+
+void cmdLoad(uint32_t arg) {
+	shellReport(reportLoad);
+}
+
+void cmdUartStats(uint32_t arg) {
+	shellReport(reportUartStats);
+}
+
+void cmdReset(uint32_t arg) {
+	resetTimerStats();
+	resetIdleStats();
+	resetIsrProfile();
+	resetUartStats();
+	USART_puts_P(stats_reset_msg);
+}
+
+void cmdSave(uint32_t arg) {
+	settingsCommit();
+	USART_puts_P(save_msg);
+}
+
+// State of the key-value store, bank and fill level first, then the boot scan
+uint8_t reportKvStats(uint8_t part) {
+	if (part == 1) {
+		USART_puts_P(kv_compactions_msg);
+		USART_putNumber(kv_compactions);
+		if (!kv_written) USART_puts_P(kv_pending_msg);
+		USART_puts_P(kv_scan_msg);
+		USART_putNumber(kv_scan_bytes);
+		USART_puts_P(kv_scan_time_msg);
+		USART_putNumber(kv_scan_us);
+		USART_Transmit('u');
+		USART_Transmit('s');
+		USART_Transmit('\r');
+		USART_Transmit('\n');
+		return 0;
+	}
+	USART_puts_P(kv_bank_msg);
+	USART_putNumber(kv_bank);
+	USART_puts_P(kv_generation_msg);
+	USART_putNumber(kv_generation);
+	USART_puts_P(kv_keys_msg);
+	USART_putNumber(kvCount());
+	USART_Transmit('/');
+	USART_putNumber(KV_KEYS);
+	USART_puts_P(kv_used_msg);
+	USART_putNumber(kv_end - kvBankStart(kv_bank));
+	USART_Transmit('/');
+	USART_putNumber(KV_BANK_SIZE);
+	return 1;
+}
+
+void cmdKvStats(uint32_t arg) {
+	shellReport(reportKvStats);
+}
+
+void cmdHelp(uint32_t arg) {
+	showMenu();
+}
+
+const ShellCommand shell_commands[] PROGMEM = {
+	{ "a", "start",  cmdStart,         SHELL_ARG_NONE,     0, 0 },
+	{ "b", "stop",   cmdStop,          SHELL_ARG_NONE,     0, 0 },
+	{ "c", "set",    cmdSetStartTime,  SHELL_ARG_REQUIRED, 0, C_MAX },
+	{ "d", "show",   cmdShowStartTime, SHELL_ARG_NONE,     0, 0 },
+	{ "e", "eeprom", cmdEeprom,        SHELL_ARG_REQUIRED, 0, E2END },
+	{ "t", "timers", cmdTimerStats,    SHELL_ARG_NONE,     0, 0 },
+	{ "l", "load",   cmdLoad,          SHELL_ARG_NONE,     0, 0 },
+	{ "u", "uart",   cmdUartStats,     SHELL_ARG_NONE,     0, 0 },
+	{ "r", "reset",  cmdReset,         SHELL_ARG_NONE,     0, 0 },
+	{ "w", "save",   cmdSave,          SHELL_ARG_NONE,     0, 0 },
+	{ "k", "kv",     cmdKvStats,       SHELL_ARG_NONE,     0, 0 },
+	{ "h", "help",   cmdHelp,          SHELL_ARG_NONE,     0, 0 },
+};
+
+// Start a new line
+void shellReset() {
+	shell.name_len = 0;
+	shell.spaces = 0;
+	shell.digits = 0;
+	shell.value = 0;
+	shell.state = SHELL_NAME;
+}
+
+// Look up the entered command and run it
+void shellExecute() {
+	if (shell.state == SHELL_ERROR) {
+		USART_puts_P(invalid_input_msg);
+		return;
+	}
+	if (shell.name_len == 0) return; // Empty line
+	shell.name[shell.name_len] = '\0';
+	
+	for (uint8_t i = 0; i < sizeof(shell_commands) / sizeof(shell_commands[0]); i++) {
+		const ShellCommand *cmd = &shell_commands[i];
+		if (strcmp_P(shell.name, cmd->name) != 0 && strcmp_P(shell.name, cmd->alias) != 0) continue;
+		
+		if (pgm_read_byte(&cmd->arg) == SHELL_ARG_NONE) {
+			if (shell.digits) {
+				USART_puts_P(no_arg_msg);
+				return;
+			}
+		} else {
+			uint32_t min = pgm_read_dword(&cmd->min);
+			uint32_t max = pgm_read_dword(&cmd->max);
+			if (!shell.digits || shell.value < min || shell.value > max) {
+				USART_puts_P(range_msg_1);
+				USART_putNumber(min);
+				USART_puts_P(range_msg_2);
+				USART_putNumber(max);
+				USART_puts_P(range_msg_3);
+				return;
+			}
+		}
+		
+		void (*handler)(uint32_t arg) = (void (*)(uint32_t))pgm_read_ptr(&cmd->handler);
+		handler(shell.value);
+		return;
+	}
+	USART_puts_P(unknown_cmd_msg);
+}
+
+// Undo the last char of the line
+void shellBackspace() {
+	switch (shell.state) {
+		case SHELL_NAME:
+			if (shell.name_len == 0) return; // Nothing to delete
+			shell.name_len--;
 			break;
-		case 'h': // Show Menu
-			showMenu();
+		case SHELL_SPACE:
+			if (--shell.spaces == 0) shell.state = SHELL_NAME;
 			break;
-		default:
-			USART_puts_P(unknown_cmd_msg);
+		case SHELL_NUMBER:
+			shell.value /= 10;
+			if (--shell.digits == 0) shell.state = shell.spaces ? SHELL_SPACE : SHELL_NAME;
+			break;
+		case SHELL_ERROR:
+			if (--shell.error_len == 0) shell.state = shell.error_state;
 			break;
 	}
-	USART_puts_P(prompt_str);
+	USART_puts("\b \b");
+}
+
+// Handle one received char
+void shellInput(uint8_t c) {
+	uint8_t last = shell.last;
+	shell.last = c;
+	
+	if (c == '\r' || c == '\n') {
+		if (c == '\n' && last == '\r') return; // Second half of CR LF
+		shellExecute();
+		shellReset();
+		if (!shell_report) USART_puts_P(prompt_str); // Otherwise after the report
+		return;
+	}
+	if (c == '\b' || c == 0x7F) {
+		shellBackspace();
+		return;
+	}
+	if (c < ' ' || c > '~') return; // Ignore other control chars
+	
+	if (shell.state == SHELL_ERROR) {
+		shell.error_len++;
+	} else if (c == ' ' && shell.state == SHELL_NAME && shell.name_len == 0) {
+		return; // Leading spaces are not echoed
+	} else if (c == ' ' && shell.state != SHELL_NUMBER) {
+		shell.spaces++;
+		shell.state = SHELL_SPACE;
+	} else if (c >= '0' && c <= '9' && shell.name_len > 0) {
+		uint8_t digit = c - '0';
+		if (shell.value > (UINT32_MAX - digit) / 10) {
+			// Number does not fit, keep the value so backspace can continue from here
+			shell.error_state = shell.state;
+			shell.error_len = 1;
+			shell.state = SHELL_ERROR;
+		} else {
+			shell.value = shell.value * 10 + digit;
+			shell.digits++;
+			shell.state = SHELL_NUMBER;
+		}
+	} else if (shell.state == SHELL_NAME && shell.name_len < SHELL_NAME_LENGTH && ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))) {
+		shell.name[shell.name_len++] = c;
+	} else {
+		shell.error_state = shell.state;
+		shell.error_len = 1;
+		shell.state = SHELL_ERROR;
+	}
+	USART_Transmit(c); // Echo
 }
 
 
@@ -351,8 +2042,13 @@ void processCommand(uint8_t cmd) {
 // CALLBACK FUNCTIONS
 // ######################################################################################
 
+// Settings unchanged for SETTINGS_IDLE_US, let the EEPROM task write them
+void event_settings_flush(void *ctx) {
+	settings_flush_due = 1;
+}
+
 // 1-second Event
-void event_count_leds() {
+void event_count_leds(void *ctx) {
 	
 	if(stopwatch_active == 1) stopwatch_counter += 1;
 	
@@ -361,6 +2057,81 @@ void event_count_leds() {
 	} else {
 		led_counter = 0;
 	}
+	
+	PORTB = (PORTB & ~(0b00000111)) | led_counter; // Update LEDs 
+}
+
+
+
+// ######################################################################################
+// TASKS
+// ######################################################################################
+
+// Shell: hands every received char to the command parser without blocking the other tasks
+uint8_t shellTask(Task *task) {
+	PT_BEGIN(task);
+	
+	// Show start menu and entry String
+	showMenu();
+	shellReset();
+	USART_puts_P(prompt_str);
+	
+	while (1) {
+		// Room for the echo or a whole reply, so the commands never wait in txQueueSlot()
+		PT_WAIT_UNTIL(task, USART_available() && txQueueFree() >= REPORT_PART_ENTRIES);
+		shellInput(USART_Receive()); // Read RingBuffer
+		
+		while (shell_report) {
+			PT_WAIT_UNTIL(task, txQueueFree() >= REPORT_PART_ENTRIES);
+			if (!shell_report(shell_report_part++)) {
+				shell_report = 0;
+				USART_puts_P(prompt_str);
+			}
+		}
+		PT_YIELD(task); // One char per pass, timers and the other tasks run in between
+	}
+	
+	PT_END(task);
+}
+
+// EEPROM: queues the changed settings for EE_READY_vect once a flush is due
+uint8_t eepromTask(Task *task) {
+	PT_BEGIN(task);
+	
+	while (1) {
+		PT_WAIT_UNTIL(task, settings_flush_due);
+		settings_flush_due = 0;
+		PT_WAIT_UNTIL(task, settingsFlush()); // Retried while the EEPROM queue is full, EE_READY_vect wakes up the idle loop
+	}
+	
+	PT_END(task);
+}
+
+// All tasks, run one after another by the main loop
+Task tasks[] = {
+	{ 0, 0, 0, shellTask },
+	{ 0, 0, 0, eepromTask },
+};
+
+// Run every task once
+// Returns 1 if any task made progress or is due, 0 if all of them are still waiting at the same place
+uint8_t runTasks() {
+	uint8_t busy = 0;
+	for (uint8_t i = 0; i < sizeof(tasks) / sizeof(tasks[0]); i++) {
+		uint16_t lc = tasks[i].lc;
+		if (tasks[i].run(&tasks[i]) != PT_WAITING || tasks[i].lc != lc) busy = 1;
+		
+		// Tasks waiting in PT_DELAY() need a timer interrupt at their wake tick
+		if (tasks[i].delaying) {
+			int32_t left = tasks[i].wake - virtualTimerTicks();
+			if (left <= 0) {
+				busy = 1; // Already due
+			} else {
+				timerWakeIn(left);
+			}
+		}
+	}
+	return busy;
 }
 
 
@@ -372,32 +2143,204 @@ void event_count_leds() {
 
 // Timer1 Compare Match ISR
 ISR(TIMER1_COMPA_vect) {
-	virtual_timer_ticks++;
+	ISR_PROFILE_ENTER();
 	
-	// Check each virtual timer
-	for (uint8_t i = 0; i < MAX_TIMERS; i++) {
-		if (timers[i].active && virtual_timer_ticks - timers[i].last_tick >= timers[i].timeout) {
-			// Timer expired -> call callback
-			// USART_Transmit('-'); // Debug
-			timers[i].callback();
-			timers[i].last_tick = virtual_timer_ticks;
+	// Ticks since the last compare match (always 1 in CTC mode)
+	uint16_t elapsed = timer_hop;
+	virtual_timer_ticks += elapsed;
+	if (virtual_timer_ticks < elapsed) virtual_timer_wraps++;
+	timer_base += elapsed * TIMER_TICK_COUNTS;
+	
+	// Only the head of the delta queue has to be counted down
+	// Pop all timers that expired within the elapsed ticks, the list of expired timers
+	// is chained over 'next' and their 'delta' holds how many ticks they are late
+	uint8_t expired_first = TIMER_NONE;
+	uint8_t expired_last = TIMER_NONE;
+	uint8_t i = timer_queue_head;
+	while (i != TIMER_NONE && timers[i].delta <= elapsed) {
+		elapsed -= timers[i].delta;
+		timer_queue_head = timers[i].next;
+		
+		timers[i].delta = elapsed;
+		timers[i].next = TIMER_NONE;
+		if (expired_last == TIMER_NONE) {
+			expired_first = i;
+		} else {
+			timers[expired_last].next = i;
 		}
+		expired_last = i;
+		
+		i = timer_queue_head;
 	}
+	if (i != TIMER_NONE) timers[i].delta -= elapsed; // Queue now counts from timer_base again
 	
-	PORTB = (PORTB & ~(0b00000111)) | led_counter; // Update LEDs 
+	// Requeue and fire the expired timers
+	i = expired_first;
+	while (i != TIMER_NONE) {
+		uint8_t next = timers[i].next;
+		uint32_t late = timers[i].delta;
+		uint32_t deadline = (virtual_timer_ticks - late) << 8; // Expiry in us
+		
+		if (timers[i].mode == TIMER_PERIODIC) {
+			// Requeue right away relative to the deadline, not to now, so lateness does not add up
+			if (late >= timers[i].timeout) {
+				timers[i].missed += late / timers[i].timeout; // Whole periods that passed unnoticed
+				late %= timers[i].timeout;
+			}
+			timerQueueInsert(i, timers[i].timeout - late);
+		} else {
+			timers[i].active = 0; // One-shot timers disarm themselves
+		}
+		
+		// Hand the callback over to the main loop, at most one pending callback per timer
+		uint8_t head = timer_event_head;
+		if (!timers[i].pending && (uint8_t)(head - timer_event_tail) < TIMER_EVENT_QUEUE_SIZE) {
+			timer_events[head & (TIMER_EVENT_QUEUE_SIZE - 1)].timer_index = i;
+			timer_events[head & (TIMER_EVENT_QUEUE_SIZE - 1)].epoch = timers[i].epoch;
+			timer_events[head & (TIMER_EVENT_QUEUE_SIZE - 1)].deadline = deadline;
+			timers[i].pending = 1;
+			timer_event_head = head + 1; // Publish the entry after it is complete
+		} else {
+			timers[i].missed++;
+		}
+		i = next;
+	}
+	
+#if TIMER_TICKLESS
+	timerProgramNext(TIMER_MAX_HOP);
+#endif
+	
+	ISR_PROFILE_EXIT(PROFILE_TIMER1_COMPA);
+}
+
+// EEPROM Ready ISR
+// The operation in progress is finished, start the next queued one that changes its byte
+ISR(EE_READY_vect) {
+	ISR_PROFILE_ENTER();
+	eeprom_active_address = 0xFFFF;
+	if (eeprom_done) {
+		*eeprom_done = 1;
+		eeprom_done = 0;
+	}
+	
+	uint8_t started = 0;
+	while (!started && eeprom_queue_tail != eeprom_queue_head) {
+		EepromOp op = eeprom_queue[eeprom_queue_tail & (EEPROM_QUEUE_SIZE - 1)];
+		eeprom_queue_tail++;
+		
+		uint8_t current = EEPROM_read(op.address);
+		uint8_t result = op.data;
+		if (op.mode == EEPROM_MODE_ERASE) result = 0xFF;
+		if (op.mode == EEPROM_MODE_WRITE) result = current & op.data;
+		if (result == current) {
+			if (op.done) *op.done = 1; // Already there, skip it
+			continue;
+		}
+		
+		EEPROM_writeMode(op.address, op.data, op.mode);
+		eeprom_active_address = op.address;
+		eeprom_active_result = result;
+		eeprom_done = op.done;
+		started = 1;
+	}
+	
+	if (!started) EECR &= ~(1 << EERIE); // Queue empty, fires as long as the EEPROM is ready otherwise
+	ISR_PROFILE_EXIT(PROFILE_EE_READY);
 }
 
 // UART RX ISR
 ISR(USART_RX_vect) {
+	ISR_PROFILE_ENTER();
+#if RX_OVERFLOW_POLICY == OVERFLOW_BLOCK
+	if (ringBufferFree(&rx_buffer) == 0) {
+		// Leave the byte in UDR0, USART_Receive() enables the interrupt again after reading
+		UCSR0B &= ~(1 << RXCIE0);
+		ISR_PROFILE_EXIT(PROFILE_USART_RX);
+		return;
+	}
+#endif
+	uint8_t status = UCSR0A; // Error flags belong to the byte in UDR0, so read them first
 	uint8_t data = UDR0; 
-	ringBufferWrite(data);
 	
-	if(rb.size >= RINGBUFFER_HIGH_LIMIT && flowcontrol == 1) {
-		USART_Transmit(XOFF);
-		flowcontrol = 0;
+	if (status & (1 << DOR0)) uart_stats.overrun++;
+	if (status & (1 << FE0)) {
+		uart_stats.framing++;
+	} else if (status & (1 << UPE0)) {
+		uart_stats.parity++;
+#if FLOW_CONTROL == FLOW_XONXOFF
+	} else if (data == XOFF) { // The other side is full, pause our transmission
+		tx_xoff = 1;
+	} else if (data == XON) {
+		tx_xoff = 0;
+		UCSR0B |= (1 << UDRIE0);
+#endif
+	} else if (!ringBufferWrite(&rx_buffer, data)) {
+#if RX_OVERFLOW_POLICY == OVERFLOW_DROP_OLDEST
+		ringBufferCommit(&rx_buffer, 1); // Main loop reads with interrupts disabled in this mode
+		ringBufferWrite(&rx_buffer, data);
+#endif
+		uart_stats.rx_drop++;
 	}
+	
+	uint8_t count = ringBufferCount(&rx_buffer);
+	if (count > uart_stats.rx_max) uart_stats.rx_max = count;
+	
+	if(count >= RINGBUFFER_HIGH_LIMIT && flowcontrol == 1 && FLOW_CONTROL != FLOW_NONE) {
+		flowStop();
+	}
+	ISR_PROFILE_EXIT(PROFILE_USART_RX);
 }
 
+// Data register empty, send the next byte (XON/XOFF first)
+// Bytes already in UDR0 and the shift register still go out after the other side stopped us
+ISR(USART_UDRE_vect) {
+	ISR_PROFILE_ENTER();
+	if (tx_priority) {
+		UDR0 = tx_priority;
+		tx_priority = 0;
+	} else if (flowTxStopped()) {
+		UCSR0B &= ~(1 << UDRIE0); // Wait for XON (USART_RX_vect) or CTS (CTS_vect)
+	} else if (tx_queue_tail != tx_queue_head) {
+		volatile TxEntry *e = &tx_queue[tx_queue_tail & (TX_QUEUE_SIZE - 1)];
+		uint8_t done;
+		switch (e->type) {
+			case TX_RING:
+				UDR0 = ringBufferRead(&tx_buffer);
+				done = --e->len == 0;
+				break;
+			case TX_RAM:
+				UDR0 = *e->ptr++;
+				done = --e->len == 0;
+				break;
+			case TX_PROGMEM:
+				UDR0 = pgm_read_byte(e->ptr++);
+				done = --e->len == 0;
+				break;
+			case TX_PSTR:
+				UDR0 = pgm_read_byte(e->ptr++);
+				done = pgm_read_byte(e->ptr) == '\0'; // The '\0' itself is not sent
+				break;
+			default: // TX_INLINE
+				UDR0 = e->data[e->pos++];
+				done = --e->len == 0;
+				break;
+		}
+		if (done) tx_queue_tail++; // Entry finished, the main loop may reuse it
+	} else {
+		UCSR0B &= ~(1 << UDRIE0); // Nothing left, the interrupt would fire forever otherwise
+	}
+	ISR_PROFILE_EXIT(PROFILE_USART_UDRE);
+}
+
+#if FLOW_CONTROL == FLOW_RTSCTS
+// CTS changed, continue sending when the other side is ready again
+ISR(CTS_vect) {
+	ISR_PROFILE_ENTER();
+	if (!flowTxStopped()) UCSR0B |= (1 << UDRIE0);
+	ISR_PROFILE_EXIT(PROFILE_CTS);
+}
+#endif
+
 
 
 
@@ -415,22 +2358,38 @@ void port_io_init() {
 
 // Initialize Timer1 Interrupts for Compare Match Mode
 void timer_interrupt_init() {
+#if TIMER_TICKLESS
+	// Keep Timer1 in normal mode, it runs freely and OCR1A is moved to the next deadline
+	TCNT1 = 0;
+	timer_base = 0;
+	timer_hop = TIMER_MAX_HOP;
+	OCR1A = TIMER_MAX_HOP * TIMER_TICK_COUNTS;
+#else
 	// Set Timer1 to CTC mode
 	TCCR1B |= (1 << WGM12);
 	
 	// Set the compare value
-	OCR1A = 63;  // For 16 MHz with 64 prescaler
+	OCR1A = TIMER_TICK_COUNTS - 1;  // 63 for 16 MHz with 64 prescaler
+#endif
 	
 	// Enable Timer1 Compare Match A interrupt
 	TIMSK1 |= (1 << OCIE1A); // Enable interrupt on compare match
 
 	// Prescaler of 64
+#if TIMER1_PRESCALER != 64
+#error "timer_interrupt_init() only sets up a prescaler of 64"
+#endif
 	TCCR1B |= (1 << CS10) | (1 << CS11);
 }
 
 void USART_Init() {
 	UBRR0H = (BAUD_CONST >> 8);
 	UBRR0L = BAUD_CONST;
+#if BAUD_U2X
+	UCSR0A |= (1 << U2X0); // Double speed
+#else
+	UCSR0A &= ~(1 << U2X0);
+#endif
 	UCSR0B |= (1 << RXEN0) | (1 << TXEN0) | (1 << RXCIE0);
 	UCSR0C |= (1 << UCSZ01) | (1 << UCSZ00);
 }
@@ -442,31 +2401,53 @@ void USART_Init() {
 // MAIN
 // ######################################################################################
 
+// Measure how long one main loop pass without work takes
+// Interrupts stay enabled, so the passes see the same memory and flash timing as in operation.
+// A batch during which an interrupt ran is measured again, the interrupt time is not idle time.
+void idleCalibrate() {
+	uint16_t loops = 0;
+	idle_loop_counts = 0;
+	while (loops < IDLE_CALIBRATION_LOOPS) {
+		uint32_t calls = isrCalls();
+		uint16_t start = TCNT1;
+		for (uint8_t i = 0; i < IDLE_CALIBRATION_BATCH; i++) {
+			dispatchTimers();
+			runTasks();
+		}
+		uint16_t counts = timer1CountsSince(start);
+		if (isrCalls() != calls) continue;
+		idle_loop_counts += counts;
+		loops += IDLE_CALIBRATION_BATCH;
+	}
+}
+
 int main() {
 	port_io_init();
+	timerInit();
 	timer_interrupt_init();
 	USART_Init();
-	ringBufferInit();
-	EEPROM_init();
+	ringBufferInit(&rx_buffer);
 	
 	sei(); // Enable Interrupts
+	
+	kvInit(); // Needs the timer interrupt to measure the scan
+	settingsLoad();
+	led_counter = getStartTime();
+	PORTB = (PORTB & ~(0b00000111)) | led_counter; // Update LEDs
 
-	declareTimer(0, 1000000, event_count_leds);  // 1-second timer to count LEDs
 
 	// Needed UART settings
-	USART_Transmit(XON);
-	flowcontrol = 1;
+	flowInit();
 	
-	// Show start menu and entry String
-    showMenu();
-    USART_puts_P(prompt_str);
+	// The first pass prints the menu, after that every task is waiting for input
+	dispatchTimers();
+	runTasks();
+	idleCalibrate();
+	resetIdleStats();
 	
-
 	while (1) {
-		
-		uint8_t c = USART_Receive(); // Read RingBuffer
-		USART_Transmit(c);
-		processCommand(c); // Process Menu input
-		
+		uint8_t busy = dispatchTimers(); // Timer callbacks (LED counter)
+		busy |= runTasks(); // Menu and EEPROM
+		if (!busy) idleSleep(); // Nothing to do until the next interrupt
 	}
 }
\ No newline at end of file
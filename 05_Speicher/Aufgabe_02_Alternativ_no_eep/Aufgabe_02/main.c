@@ -13,10 +13,26 @@
 
 // UART defines
 #define BAUDRATE 9600
-#define BAUD_CONST (((F_CPU/(BAUDRATE*16UL)))-1)
+#define BAUD_MAX_ERROR_PERMILLE 25 // Max. deviation of the real baud rate (2.5 %, 115200 with U2X has 2.1 %)
+// Rounded UBRR for normal (16 samples per bit) and double speed mode (U2X0, 8 samples per bit)
+#define BAUD_UBRR_16 ((F_CPU + 8UL * BAUDRATE) / (16UL * BAUDRATE) - 1)
+#define BAUD_UBRR_8  ((F_CPU + 4UL * BAUDRATE) / (8UL * BAUDRATE) - 1)
+#define BAUD_ERROR_16 (BAUD_ERROR(16UL * BAUDRATE * (BAUD_UBRR_16 + 1)))
+#define BAUD_ERROR_8  (BAUD_ERROR(8UL * BAUDRATE * (BAUD_UBRR_8 + 1)))
+#define BAUD_ERROR(clk) (((clk) > F_CPU ? (clk) - F_CPU : F_CPU - (clk)) * 1000 / (clk)) // Permille
+// Double speed only if it is more accurate, normal mode samples more often and tolerates more noise
+#define BAUD_U2X (BAUD_ERROR_8 < BAUD_ERROR_16)
+#define BAUD_CONST (BAUD_U2X ? BAUD_UBRR_8 : BAUD_UBRR_16)
+#define BAUD_ERROR_PERMILLE (BAUD_U2X ? BAUD_ERROR_8 : BAUD_ERROR_16)
+#if BAUD_ERROR_PERMILLE > BAUD_MAX_ERROR_PERMILLE
+#error "BAUDRATE cannot be reached with this F_CPU"
+#endif
+#if BAUD_CONST > 4095
+#error "BAUDRATE too low for this F_CPU"
+#endif
 
 // Ring buffer parameters
-#define RINGBUFFER_SIZE 32
+#define RINGBUFFER_SIZE 32 // Receive buffer (power of two, max. 128)
 #define RINGBUFFER_HIGH_LIMIT 20
 #define RINGBUFFER_LOW_LIMIT 4
 
@@ -25,8 +41,9 @@
 #define XOFF 0x13
 
 // EEPROM 
-#define STARTTIME_VALUE 4
-#define STARTTIME_ADDR 0
+#define STARTTIME_VALUE 4   // Used as long as no Starttime is stored
+#define EE_TABLE_ENTRIES 8  // Records in the pointer table (IDs 0 to 7)
+#define EE_ID_STARTTIME 0   // Record ID of the Starttime
 
 
 #include <stdint.h>
@@ -35,6 +52,8 @@
 #include <avr/interrupt.h>
 #include <avr/pgmspace.h>
 #include <avr/eeprom.h>
+#include <util/crc16.h>
+#include "../../../Common/ringbuffer.h"
 
 
 // Global Variables for LEDs and Timer
@@ -95,10 +114,6 @@ uint8_t flip_int_first_3bit(uint32_t val){
 	return flipped;
 }
 
-uint8_t flip_3bit_ascii_for_counter(uint8_t a){
-	return int_to_ascii(flip_int_first_3bit(ascii_to_int(a)));
-}
-
 
 
 // ######################################################################################
@@ -130,6 +145,194 @@ uint8_t EEPROM_read(uint16_t address){
 	return EEDR;
 }
 
+// Pointer table (Methode 2 from 05_Speicher/Aufgabe_03/03.md)
+// The first bytes of the EEPROM map every record ID to the address and length of its data.
+// A record is written to a new place every time and the table entry is switched afterwards,
+// so the data moves through the whole data area and an interrupted write keeps the old data.
+// Every entry is stored twice: addr (2 bytes), len, seq (2 bytes), check. A new entry goes into
+// the copy that is not in use, its check byte is erased first and written last. The valid copy
+// with the newer seq counts, so a reset while the entry is written leaves the old copy in use.
+// seq counts the entry writes of the whole table, the newest entry shows where the last record went.
+//
+// Only the data bytes are spread, the table is not: every update of a record rewrites the check
+// byte of one of its two copies twice (erased, then set), so the check bytes see one write per
+// update, the same as a fixed cell. A one byte record like the start time therefore lasts no
+// longer than in the baseline, the table entry wears out first.
+// All writes use the blocking EEPROM_write(), eeWrite() stalls the main loop for about
+// 3.4 ms per changed byte (up to 6 entry bytes plus the data).
+typedef struct {
+	uint16_t addr; // Start of the data, EE_ADDR_NONE = no record
+	uint8_t len;   // Length in bytes
+} EeEntry;
+
+#define EE_ENTRY_SIZE 6     // Stored size of one copy of an entry
+#define EE_CHECK_NONE 0xFF  // Check byte of a copy that is not valid (erased)
+#define EE_TABLE_START 0
+#define EE_DATA_START (EE_TABLE_START + EE_TABLE_ENTRIES * 2 * EE_ENTRY_SIZE)
+#define EE_DATA_END (E2END + 1)
+#define EE_ADDR_NONE 0xFFFF // Unused entry
+
+EeEntry ee_table[EE_TABLE_ENTRIES]; // Copy of the table, lookups need no EEPROM access
+uint8_t ee_copy[EE_TABLE_ENTRIES];  // Copy in use (0 or 1)
+uint16_t ee_seq = 0;                // seq of the newest entry in the table
+uint16_t ee_next = EE_DATA_START;  // The search for free space starts here (next fit)
+
+// Write a byte only if it differs, saves time and wear
+void EEPROM_update(uint16_t address, uint8_t data){
+	if (EEPROM_read(address) != data) EEPROM_write(address, data);
+}
+
+uint16_t eeEntryAddress(uint8_t id, uint8_t copy){
+	return EE_TABLE_START + (id * 2 + copy) * EE_ENTRY_SIZE;
+}
+
+// Check byte of an entry copy, never EE_CHECK_NONE
+uint8_t eeEntryCheck(const uint8_t *bytes){
+	uint8_t crc = 0;
+	for (uint8_t i = 0; i < EE_ENTRY_SIZE - 1; i++) crc = _crc8_ccitt_update(crc, bytes[i]);
+	return crc == EE_CHECK_NONE ? 0 : crc;
+}
+
+// Store one entry of the RAM table in the copy that is not in use, then switch to it
+void eeWriteEntry(uint8_t id){
+	uint8_t copy = !ee_copy[id];
+	uint16_t address = eeEntryAddress(id, copy);
+	uint16_t seq = ee_seq + 1;
+	uint8_t bytes[EE_ENTRY_SIZE - 1] = { ee_table[id].addr & 0xFF, ee_table[id].addr >> 8, ee_table[id].len, seq & 0xFF, seq >> 8 };
+	
+	EEPROM_update(address + EE_ENTRY_SIZE - 1, EE_CHECK_NONE); // Invalid until it is complete
+	for (uint8_t i = 0; i < EE_ENTRY_SIZE - 1; i++) EEPROM_update(address + i, bytes[i]);
+	EEPROM_update(address + EE_ENTRY_SIZE - 1, eeEntryCheck(bytes));
+	
+	ee_copy[id] = copy;
+	ee_seq = seq;
+}
+
+// Read one copy of an entry, returns 0 if it is not valid
+uint8_t eeReadEntry(uint8_t id, uint8_t copy, uint8_t *bytes){
+	uint16_t address = eeEntryAddress(id, copy);
+	for (uint8_t i = 0; i < EE_ENTRY_SIZE - 1; i++) bytes[i] = EEPROM_read(address + i);
+	return EEPROM_read(address + EE_ENTRY_SIZE - 1) == eeEntryCheck(bytes);
+}
+
+// seq of a copy read by eeReadEntry()
+uint16_t eeEntrySeq(const uint8_t *bytes){
+	return bytes[3] | (bytes[4] << 8);
+}
+
+// Load the table into RAM, entries that point outside the data area count as unused
+void eeInit(){
+	uint8_t newest = EE_TABLE_ENTRIES; // Entry written last that still points to a record
+	uint16_t newest_seq = 0;
+	uint8_t any = 0;
+	for (uint8_t id = 0; id < EE_TABLE_ENTRIES; id++) {
+		uint8_t bytes0[EE_ENTRY_SIZE - 1], bytes1[EE_ENTRY_SIZE - 1];
+		uint8_t valid0 = eeReadEntry(id, 0, bytes0);
+		uint8_t valid1 = eeReadEntry(id, 1, bytes1);
+		// Both valid: the newer one was written last
+		uint8_t copy = valid1 && (!valid0 || (int16_t)(eeEntrySeq(bytes1) - eeEntrySeq(bytes0)) > 0);
+		uint8_t *bytes = copy ? bytes1 : bytes0;
+		uint16_t seq = eeEntrySeq(bytes);
+		ee_copy[id] = copy;
+		if (valid0 || valid1) {
+			// New entries must be newer than every stored one
+			if (!any || (int16_t)(seq - ee_seq) > 0) ee_seq = seq;
+			any = 1;
+		}
+		
+		uint16_t addr = bytes[0] | (bytes[1] << 8);
+		uint8_t len = bytes[2];
+		if ((!valid0 && !valid1) || addr < EE_DATA_START || len == 0 || addr + len > EE_DATA_END) {
+			addr = EE_ADDR_NONE;
+			len = 0;
+		}
+		ee_table[id].addr = addr;
+		ee_table[id].len = len;
+		if (addr != EE_ADDR_NONE && (newest == EE_TABLE_ENTRIES || (int16_t)(seq - newest_seq) > 0)) {
+			newest = id;
+			newest_seq = seq;
+		}
+	}
+	// Continue behind the record written last, after a wrap of eeAlloc() that is not the highest address
+	ee_next = newest == EE_TABLE_ENTRIES ? EE_DATA_START : ee_table[newest].addr + ee_table[newest].len;
+	if (ee_next >= EE_DATA_END) ee_next = EE_DATA_START;
+}
+
+// Returns the ID of a record that overlaps [addr, addr + len), EE_TABLE_ENTRIES if the area is free
+uint8_t eeOverlap(uint16_t addr, uint8_t len){
+	for (uint8_t id = 0; id < EE_TABLE_ENTRIES; id++) {
+		uint16_t start = ee_table[id].addr;
+		if (start == EE_ADDR_NONE) continue;
+		if (addr < start + ee_table[id].len && start < addr + len) return id;
+	}
+	return EE_TABLE_ENTRIES;
+}
+
+// Find 'len' free bytes from ee_next on, wraps around the data area once
+// Returns EE_ADDR_NONE if there is no gap that is large enough
+uint16_t eeAlloc(uint8_t len){
+	uint16_t addr = ee_next;
+	uint16_t searched = 0;
+	while (searched < EE_DATA_END - EE_DATA_START) {
+		if (addr + len > EE_DATA_END) {
+			// Does not fit before the end, continue at the start
+			searched += EE_DATA_END - addr;
+			addr = EE_DATA_START;
+			continue;
+		}
+		uint8_t id = eeOverlap(addr, len);
+		if (id == EE_TABLE_ENTRIES) return addr;
+		uint16_t end = ee_table[id].addr + ee_table[id].len; // Skip the record in the way
+		searched += end - addr;
+		addr = end;
+	}
+	return EE_ADDR_NONE;
+}
+
+// Store 'len' bytes (1-255) as record 'id' at a new place
+// Returns 0 if the ID is invalid or the EEPROM is full
+uint8_t eeWrite(uint8_t id, const void *data, uint8_t len){
+	if (id >= EE_TABLE_ENTRIES || len == 0) return 0;
+	uint16_t addr = eeAlloc(len); // Never overlaps the old data of this record
+	if (addr == EE_ADDR_NONE) return 0;
+	
+	for (uint8_t i = 0; i < len; i++) {
+		EEPROM_update(addr + i, ((const uint8_t *)data)[i]);
+	}
+	
+	// Switch the entry to the new data, the old place becomes free
+	ee_table[id].addr = addr;
+	ee_table[id].len = len;
+	eeWriteEntry(id);
+	ee_next = addr + len;
+	return 1;
+}
+
+// Copy record 'id' into 'data' (at most 'max_len' bytes)
+// Returns the number of bytes copied, 0 if there is no such record
+uint8_t eeRead(uint8_t id, void *data, uint8_t max_len){
+	if (id >= EE_TABLE_ENTRIES || ee_table[id].addr == EE_ADDR_NONE) return 0;
+	uint8_t len = ee_table[id].len < max_len ? ee_table[id].len : max_len;
+	for (uint8_t i = 0; i < len; i++) {
+		((uint8_t *)data)[i] = EEPROM_read(ee_table[id].addr + i);
+	}
+	return len;
+}
+
+// Length of record 'id', 0 if there is none
+uint8_t eeLength(uint8_t id){
+	if (id >= EE_TABLE_ENTRIES || ee_table[id].addr == EE_ADDR_NONE) return 0;
+	return ee_table[id].len;
+}
+
+// Remove record 'id', its space becomes free
+void eeDelete(uint8_t id){
+	if (id >= EE_TABLE_ENTRIES || ee_table[id].addr == EE_ADDR_NONE) return;
+	ee_table[id].addr = EE_ADDR_NONE;
+	ee_table[id].len = 0;
+	eeWriteEntry(id);
+}
+
 
 
 // ######################################################################################
@@ -178,41 +381,10 @@ void cancelTimer(uint8_t timer_index) {
 
 
 // ######################################################################################
-// RINGBUFFER FUNCTIONS
+// RINGBUFFERS (type and functions in Common/ringbuffer.h)
 // ######################################################################################
 
-typedef struct {
-	uint8_t buffer[RINGBUFFER_SIZE];
-	uint8_t head; // Pointer to the next write position in the buffer
-	uint8_t tail; // Pointer to the next read position in the buffer
-	uint8_t size; // Tracks the number of elements currently in the buffer
-} RingBuffer;
-
-volatile RingBuffer rb;
-
-// Initialize an empty ring buffer
-void ringBufferInit() {
-	rb.head = rb.tail = 0;
-	rb.size = 0;
-}
-
-// Write data to the buffer
-void ringBufferWrite(uint8_t data) {
-	rb.buffer[rb.head] = data; // Write the data to the buffer at the head position
-	rb.head = (rb.head + 1) % RINGBUFFER_SIZE; // Move the head pointer to the next position, wrapping around if needed
-	rb.size++; // Increment the size of the buffer
-}
-
-// Read data from the buffer
-uint8_t ringBufferRead() {
-	uint8_t data = 0;
-	if (rb.size > 0) { // Check if the buffer is not empty
-		data = rb.buffer[rb.tail]; // Read the data from the buffer at the tail position
-		rb.tail = (rb.tail + 1) % RINGBUFFER_SIZE; // Move the tail pointer to the next position, wrapping around if needed
-		rb.size--; // Decrement the size of the buffer
-	}
-	return data;
-}
+RINGBUFFER(rx_buffer, RINGBUFFER_SIZE);
 
 
 
@@ -230,9 +402,9 @@ void USART_Transmit(unsigned char data){
 
 // Read received char from Ringbuffer
 unsigned char USART_Receive(){
-	while(rb.size == 0); // Wait until there is something in the Buffer
-	uint8_t data = ringBufferRead();
-	if(rb.size <= RINGBUFFER_LOW_LIMIT && flowcontrol == 0) {
+	while(ringBufferCount(&rx_buffer) == 0); // Wait until there is something in the Buffer
+	uint8_t data = ringBufferRead(&rx_buffer);
+	if(ringBufferCount(&rx_buffer) <= RINGBUFFER_LOW_LIMIT && flowcontrol == 0) {
 		USART_Transmit(XON);
 		flowcontrol = 1;
 	}
@@ -254,12 +426,29 @@ void USART_puts_P(const char *str) {
 	}
 }
 
+// Send unsigned number as decimal string, digits go straight to the UART so no buffer can overflow
+void USART_putU32(uint32_t val) {
+	static const uint32_t pow10[9] PROGMEM = {1000000000UL, 100000000UL, 10000000UL, 1000000UL, 100000UL, 10000UL, 1000UL, 100UL, 10UL};
+	uint8_t started = 0;
+	for (uint8_t i = 0; i < 9; i++) {
+		uint32_t p = pgm_read_dword(&pow10[i]);
+		char digit = '0';
+		while (val >= p) { // Subtract instead of a 32 bit division
+			val -= p;
+			digit++;
+		}
+		if (digit != '0') started = 1;
+		if (started) USART_Transmit(digit);
+	}
+	USART_Transmit('0' + val);
+}
+
 // Show start menu
 void showMenu() {
 	USART_puts_P(menu_str);
 }
 
-// Reads the Starttime from User. 
+// Reads the Starttime from User, returns it flipped for the LED counter (0-7)
 uint8_t USART_readNumber() {
 
 	uint8_t val = USART_Receive();
@@ -267,22 +456,20 @@ uint8_t USART_readNumber() {
 	if (val >= '0' && val <= '7') {
 		// Accept only digits from 0 to 7
 		USART_Transmit(val);
-		return flip_3bit_ascii_for_counter(val);
+		return flip_int_first_3bit(ascii_to_int(val));
 	}
 	
 	if (val == '\r' || val == '\n') {
 		// End of entry
 		USART_Transmit('\r');
 		USART_Transmit('\n');
-		val = '0';
-		return flip_3bit_ascii_for_counter(val);
+		return flip_int_first_3bit(0);
 	}
 	
 	// Ignore characters outside '0'-'7'
 	USART_puts_P(invalid_time_msg);
 	USART_puts_P(set_time_msg);
-	USART_readNumber();
-	return 0;
+	return USART_readNumber();
 }
 
 // Process menu
@@ -297,26 +484,26 @@ void processCommand(uint8_t cmd) {
 		case 'b': // Stop
 			cancelTimer(0); // Stop LED counter timer
 			stopwatch_active = 0;
-			char b_buffer_1[4]; char b_buffer_2[4];
 			USART_puts_P(stop_msg_1);
-			USART_puts(itoa(stopwatch_counter, b_buffer_1, 10));
+			USART_putU32(stopwatch_counter);
 			USART_puts_P(stop_msg_2);
-			USART_puts(itoa(flip_int_first_3bit(led_counter), b_buffer_2, 10));
+			USART_putU32(flip_int_first_3bit(led_counter));
 			USART_Transmit('\r');
 			USART_Transmit('\n');
 			stopwatch_counter = 0;
 			break;
 		case 'c': { // Set Starttime
 			USART_puts_P(set_time_msg);
-			led_counter, start_time = (uint8_t)USART_readNumber();
-			EEPROM_write((uint16_t)STARTTIME_ADDR, start_time); // Write new starttime to EEPROM
+			uint8_t val = USART_readNumber();
+			start_time = val;
+			led_counter = val;
+			eeWrite(EE_ID_STARTTIME, &val, 1); // Write new starttime to EEPROM
 			PORTB = (PORTB & ~(0b00000111)) | led_counter; // Update LEDs
 			break;
 		}
 		case 'd': // Show current Starttime
 			USART_puts_P(show_time_msg);
-			char d_buffer_1[4];
-			USART_puts(itoa(flip_int_first_3bit(start_time), d_buffer_1, 10));
+			USART_putU32(flip_int_first_3bit(start_time));
 			USART_Transmit('\r');
 			USART_Transmit('\n');
 			break;
@@ -375,9 +562,9 @@ ISR(TIMER1_COMPA_vect) {
 // UART RX ISR
 ISR(USART_RX_vect) {
 	uint8_t data = UDR0; // The received character is ready here.
-	ringBufferWrite(data);
+	ringBufferWrite(&rx_buffer, data); // Dropped if the buffer is full
 	
-	if(rb.size >= RINGBUFFER_HIGH_LIMIT && flowcontrol == 1) {
+	if(ringBufferCount(&rx_buffer) >= RINGBUFFER_HIGH_LIMIT && flowcontrol == 1) {
 		USART_Transmit(XOFF);
 		flowcontrol = 0;
 	}
@@ -416,6 +603,11 @@ void timer_interrupt_init() {
 void USART_Init() {
 	UBRR0H = (BAUD_CONST >> 8);
 	UBRR0L = BAUD_CONST;
+#if BAUD_U2X
+	UCSR0A |= (1 << U2X0); // Double speed
+#else
+	UCSR0A &= ~(1 << U2X0);
+#endif
 	UCSR0B |= (1 << RXEN0) | (1 << TXEN0) | (1 << RXCIE0);
 	UCSR0C |= (1 << UCSZ01) | (1 << UCSZ00);
 }
@@ -431,7 +623,7 @@ int main() {
 	port_io_init();
 	timer_interrupt_init();
 	USART_Init();
-	ringBufferInit();
+	ringBufferInit(&rx_buffer);
 	
 	sei(); // Enable Interrupts
 
@@ -442,7 +634,11 @@ int main() {
 	flowcontrol = 1;
 		
 	// Load Values from EEPROM
-	led_counter, start_time = EEPROM_read((uint16_t)STARTTIME_ADDR);
+	eeInit();
+	uint8_t val;
+	if (!eeRead(EE_ID_STARTTIME, &val, 1)) val = flip_int_first_3bit(STARTTIME_VALUE);
+	start_time = val;
+	led_counter = val;
 	
 	// Show start menu and entry String
     showMenu();
@@ -6,15 +6,43 @@
  */ 
 
 #define F_CPU 16000000UL
+#define TELEMETRY_BINARY 0 // 0 = text lines every 200 ms, 1 = COBS framed binary packets (see Telemetry_Decoder), needs 500000 baud on the PC
+#if TELEMETRY_BINARY
+#define BAUDRATE 500000 // 50 kB/s, about 27 bytes per block of 8 samples at ~9600 samples/s
+#else
 #define BAUDRATE 9600
-#define BAUD_CONST (((F_CPU/(BAUDRATE*16UL)))-1)
+#endif
+#define BAUD_MAX_ERROR_PERMILLE 25 // Max. deviation of the real baud rate (2.5 %, 115200 with U2X has 2.1 %)
+// Rounded UBRR for normal (16 samples per bit) and double speed mode (U2X0, 8 samples per bit)
+#define BAUD_UBRR_16 ((F_CPU + 8UL * BAUDRATE) / (16UL * BAUDRATE) - 1)
+#define BAUD_UBRR_8  ((F_CPU + 4UL * BAUDRATE) / (8UL * BAUDRATE) - 1)
+#define BAUD_ERROR_16 (BAUD_ERROR(16UL * BAUDRATE * (BAUD_UBRR_16 + 1)))
+#define BAUD_ERROR_8  (BAUD_ERROR(8UL * BAUDRATE * (BAUD_UBRR_8 + 1)))
+#define BAUD_ERROR(clk) (((clk) > F_CPU ? (clk) - F_CPU : F_CPU - (clk)) * 1000 / (clk)) // Permille
+// Double speed only if it is more accurate, normal mode samples more often and tolerates more noise
+#define BAUD_U2X (BAUD_ERROR_8 < BAUD_ERROR_16)
+#define BAUD_CONST (BAUD_U2X ? BAUD_UBRR_8 : BAUD_UBRR_16)
+#define BAUD_ERROR_PERMILLE (BAUD_U2X ? BAUD_ERROR_8 : BAUD_ERROR_16)
+#if BAUD_ERROR_PERMILLE > BAUD_MAX_ERROR_PERMILLE
+#error "BAUDRATE cannot be reached with this F_CPU"
+#endif
+#if BAUD_CONST > 4095
+#error "BAUDRATE too low for this F_CPU"
+#endif
 #define STABILIZATION_DELAY_MS 5
+#define UART_TX_BUFFER_SIZE 128 // Transmit buffer, drained by the UDRE interrupt (power of two, max. 128)
+#define ADC_BLOCK_SAMPLES 8 // Samples per telemetry packet
+#define ADC_BUFFER_SIZE 64  // Sample blocks waiting for the UART (power of two, max. 128)
+#define ADC_SAMPLE_US 104   // Free running: 13 ADC clocks at 125 kHz per conversion
+#define TELEMETRY_PWM_EVERY 32   // PWM packet after every 32 sample blocks (~38 per second)
 
 
 #include <avr/io.h>
 #include <util/delay.h>
-#include <stdio.h>
-#include <avr/interrupt.h>  
+#include <avr/pgmspace.h>
+#include <avr/interrupt.h>
+#include "../../../../Common/ringbuffer.h"
+#include "../../../Telemetry/telemetry.h"
 
 
 typedef struct analog {
@@ -25,6 +53,16 @@ typedef struct analog {
 
 
 
+// ---------------------------------------------------------------------------
+// Ring buffer
+// ---------------------------------------------------------------------------
+
+RINGBUFFER(uart_tx_buffer, UART_TX_BUFFER_SIZE); // Filled by the main loop, drained by USART_UDRE_vect
+RINGBUFFER(adc_buffer, ADC_BUFFER_SIZE);         // Sample blocks, filled by ADC_vect, read by the main loop
+
+
+
+
 // ---------------------------------------------------------------------------
 // UART
 // ---------------------------------------------------------------------------
@@ -32,26 +70,113 @@ void uart_init(){
 	// set UBRR0H and UBRR0L
 	UBRR0H = (BAUD_CONST >> 8);
 	UBRR0L = BAUD_CONST;
+#if BAUD_U2X
+	UCSR0A |= (1 << U2X0); // Double speed
+#else
+	UCSR0A &= ~(1 << U2X0);
+#endif
 	// Frame-Format: 8 Databits, 1 Stopbit, no Parity
 	UCSR0C = (1 << UCSZ01) | (1 << UCSZ00);
 	// Enable RX and TX
 	UCSR0B = (1 << TXEN0);
 }
 
+// Queue up to len bytes without waiting, returns the number of bytes queued
+uint8_t uart_write(const uint8_t* data, uint8_t len){
+	len = ringBufferWriteN(&uart_tx_buffer, data, len);
+	if (len > 0) UCSR0B |= (1 << UDRIE0); // Data Register Empty interrupt sends them
+	return len;
+}
+
+// Queue all bytes, only waits while the buffer is full (not inside an interrupt)
+void uart_write_blocking(const uint8_t* data, uint16_t len){
+	while (len > 0){
+		uint8_t n = uart_write(data, len > 255 ? 255 : len);
+		data += n;
+		len -= n;
+	}
+}
+
 void uart_putchar(char c){
-	// Wait until Data Register is emtpy
-	while (!(UCSR0A & (1 << UDRE0)));
-	// Then write into Register
-	UDR0 = c;
+	uart_write_blocking((const uint8_t*)&c, 1);
 }
 
 void uart_print(const char* str){
-	while (*str){
-		uart_putchar(*str++);
+	uint16_t len = 0;
+	while (str[len]) len++;
+	uart_write_blocking((const uint8_t*)str, len);
+}
+
+ISR(USART_UDRE_vect){
+	if (ringBufferCount(&uart_tx_buffer) > 0){
+		UDR0 = ringBufferRead(&uart_tx_buffer);
+	} else {
+		UCSR0B &= ~(1 << UDRIE0); // Buffer empty, otherwise the interrupt fires forever
+	}
+}
+
+
+// ---------------------------------------------------------------------------
+// Formatting (replaces sprintf, writes straight into the UART transmit buffer)
+// ---------------------------------------------------------------------------
+// Powers of ten, 10^9 down to 10^1
+const uint32_t pow10_table[9] PROGMEM = { 1000000000, 100000000, 10000000, 1000000, 100000, 10000, 1000, 100, 10 };
+
+// Decimal digits of val, at least min_digits (leading zeros), '.' before the last 'decimals' digits
+// Digits are found by subtracting the powers of ten, much cheaper than a 32 bit division on the AVR
+void uart_put_decimal(uint32_t val, uint8_t min_digits, uint8_t decimals){
+	uint8_t started = 0;
+	for (uint8_t i = 0; i < 9; i++){
+		uint8_t pos = 9 - i; // Digit position, 0 = ones
+		uint32_t p = pgm_read_dword(&pow10_table[i]);
+		char digit = '0';
+		while (val >= p){
+			val -= p;
+			digit++;
+		}
+		if (digit != '0' || pos < min_digits || pos < decimals + 1) started = 1;
+		if (started){
+			uart_putchar(digit);
+			if (pos == decimals) uart_putchar('.');
+		}
+	}
+	uart_putchar('0' + val);
+}
+
+void uart_put_u32(uint32_t val){
+	uart_put_decimal(val, 1, 0);
+}
+
+void uart_put_i32(int32_t val){
+	if (val < 0){
+		uart_putchar('-');
+		uart_put_decimal(0 - (uint32_t)val, 1, 0);
+	} else {
+		uart_put_decimal(val, 1, 0);
+	}
+}
+
+// Fixed point, e.g. 3300 mV with decimals = 3 -> "3.300"
+void uart_put_fixed(int32_t val, uint8_t decimals){
+	uint32_t magnitude = val;
+	if (val < 0){
+		uart_putchar('-');
+		magnitude = 0 - (uint32_t)val;
+	}
+	uart_put_decimal(magnitude, 1, decimals);
+}
+
+// Lowest 'digits' nibbles of val as hex
+void uart_put_hex(uint32_t val, uint8_t digits){
+	while (digits-- > 0){
+		uint8_t nibble = (val >> (4 * digits)) & 0x0F;
+		uart_putchar(nibble < 10 ? '0' + nibble : 'A' - 10 + nibble);
 	}
 }
 
 
+
+
 // ---------------------------------------------------------------------------
 // ADC
 // ---------------------------------------------------------------------------
@@ -62,6 +187,41 @@ void adc_init(){
 	| (1 << ADPS0);
 }
 
+// Samples are collected in blocks, the block carries the number of its first conversion as timestamp
+typedef struct {
+	uint32_t start;                      // Conversions since adc_start_free_running() (1 conversion = ADC_SAMPLE_US)
+	uint16_t samples[ADC_BLOCK_SAMPLES];
+} AdcBlock;
+_Static_assert(ADC_BLOCK_SAMPLES <= TELEMETRY_MAX_VALUES, "A sample block must fit into one telemetry packet");
+
+volatile uint32_t adc_index = 0;    // Number of the next conversion
+volatile uint16_t adc_dropped = 0;  // Blocks lost because the ring buffer was full (gap in the timestamps)
+AdcBlock adc_block;                 // Block being filled, only used by the ISR
+uint8_t adc_block_fill = 0;
+
+// Convert ADC0 (poti, AVCC reference) continuously, every result triggers ADC_vect
+void adc_start_free_running(){
+	ADMUX = (1 << REFS0);
+	ADCSRB = 0; // Auto trigger source: free running
+	ADCSRA |= (1 << ADATE) | (1 << ADIE) | (1 << ADSC);
+}
+
+ISR(ADC_vect){
+	if (adc_block_fill == 0) adc_block.start = adc_index;
+	adc_block.samples[adc_block_fill++] = ADC;
+	adc_index++;
+
+	if (adc_block_fill == ADC_BLOCK_SAMPLES){
+		adc_block_fill = 0;
+		// Only whole blocks, so every block in the buffer has a correct timestamp
+		if (ringBufferFree(&adc_buffer) >= sizeof(AdcBlock)){
+			ringBufferWriteN(&adc_buffer, (const uint8_t*)&adc_block, sizeof(AdcBlock));
+		} else {
+			adc_dropped++;
+		}
+	}
+}
+
 uint16_t adc_read(){
 	ADCSRA |= (1 << ADSC); // Start Conversion
 	while (ADCSRA & (1 << ADSC)); // Wait until Conversion is finished
@@ -179,13 +339,38 @@ int main(void){
 	uart_init();
 	adc_init();
 	timer0_pwm_init();
-	timer1_icp_init(); 
+	timer1_icp_init(); // Also enables the interrupts needed by the UART and ADC
+
+#if TELEMETRY_BINARY
+	uint8_t blocks = 0;
+	adc_start_free_running();
 
+	while (1){
+		if (ringBufferCount(&adc_buffer) < sizeof(AdcBlock)) continue;
+
+		AdcBlock block;
+		ringBufferReadN(&adc_buffer, (uint8_t*)&block, sizeof(AdcBlock));
+		telemetry_send(TELEMETRY_CHANNEL_POTI, block.start, block.samples, ADC_BLOCK_SAMPLES);
+
+		// Newest sample sets the duty cycle (0..1023 -> 0..255)
+		OCR0B = (uint32_t)block.samples[ADC_BLOCK_SAMPLES - 1] * (uint32_t)255 / (uint32_t)1023;
+
+		if (++blocks == TELEMETRY_PWM_EVERY){
+			blocks = 0;
+			uint16_t pwm[3];
+			pwm[0] = OCR0B;
+			cli(); // 16 bit values written by TIMER1_CAPT_vect
+			pwm[1] = highTime;
+			pwm[2] = lowTime;
+			sei();
+			telemetry_send(TELEMETRY_CHANNEL_PWM, block.start, pwm, 3);
+		}
+	}
+#else
 	analog poti;
 	uint8_t duty;
 	uint16_t icp_total;
 	uint8_t icp_duty = 0;
-	char buffer[128];
 
 	while (1){
 		
@@ -207,11 +392,21 @@ int main(void){
 		}
 		
 		// Print out the set duty in raw ADC and raw OCR0A
-		sprintf(buffer, "Poti ADC: %d\nDuty Cycle: %d\nOCR0B: %d\nICP1: %d%%\n\r", poti.adc, duty, OCR0B, icp_duty);
-		uart_print(buffer);
+		uart_print("Poti ADC: ");
+		uart_put_u32(poti.adc);
+		uart_print("\nDuty Cycle: ");
+		uart_put_fixed((uint32_t)duty * 1000 / 255, 1); // Permille -> "xx.x"
+		uart_print("%\nOCR0B: 0x");
+		uart_put_hex(OCR0B, 2);
+		uart_print("\nICP1: ");
+		uart_put_u32(icp_duty);
+		uart_print("%, Deviation: ");
+		uart_put_i32((int32_t)icp_duty - (int32_t)((uint32_t)duty * 100 / 255)); // Measured minus set duty cycle
+		uart_print("%\n\r");
 		
 		_delay_ms(200);
 	}
+#endif
 
 	return 0;
 }
@@ -0,0 +1,84 @@
+/*
+ * telemetry.h
+ *
+ * Binary telemetry of 6a_Inputs/Aufgabe_02 and 6b_Outputs/Aufgabe_04 (TELEMETRY_BINARY 1)
+ * The packet layout below is also used by Telemetry_Decoder/telemetry_decoder.cpp.
+ *
+ * Packet: seq (u8), channel (u8), timestamp (u32, ADC conversions), count (u8), count * value (u16), CRC16
+ * All numbers little endian, CRC16/XMODEM over all bytes before it
+ * The packet is COBS encoded, so it contains no 0x00 and a 0x00 marks its end
+ */
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdint.h>
+
+#define TELEMETRY_HEADER_SIZE 7  // seq, channel, timestamp, count
+#define TELEMETRY_MAX_VALUES 8
+#define TELEMETRY_CHANNEL_POTI 0 // Raw ADC0 samples, one per conversion starting at the timestamp
+#define TELEMETRY_CHANNEL_PWM 1  // OCR0B, ICP1 high time, ICP1 low time (Timer1 counts)
+
+#ifdef __AVR__
+#include <util/crc16.h>
+
+// Queue all bytes for the UART, provided by main.c
+void uart_write_blocking(const uint8_t* data, uint16_t len);
+
+// COBS: every 0x00 is replaced by the distance to the next one, 'out' needs len + 2 bytes
+static inline uint8_t cobs_encode(const uint8_t* in, uint8_t len, uint8_t* out){
+	uint8_t code_pos = 0; // Where the distance of the current block goes
+	uint8_t code = 1;
+	uint8_t o = 1;
+
+	for (uint8_t i = 0; i < len; i++){
+		if (in[i] == 0){
+			out[code_pos] = code;
+			code_pos = o++;
+			code = 1;
+		} else {
+			out[o++] = in[i];
+			if (++code == 0xFF){ // Max. block length
+				out[code_pos] = code;
+				code_pos = o++;
+				code = 1;
+			}
+		}
+	}
+	out[code_pos] = code;
+	return o;
+}
+
+// Send one packet with up to TELEMETRY_MAX_VALUES values
+static inline void telemetry_send(uint8_t channel, uint32_t timestamp, const uint16_t* values, uint8_t count){
+	static uint8_t seq = 0; // Lets the receiver detect lost packets
+	uint8_t packet[TELEMETRY_HEADER_SIZE + 2 * TELEMETRY_MAX_VALUES + 2];
+	uint8_t n = 0;
+
+	packet[n++] = seq++;
+	packet[n++] = channel;
+	packet[n++] = timestamp;
+	packet[n++] = timestamp >> 8;
+	packet[n++] = timestamp >> 16;
+	packet[n++] = timestamp >> 24;
+	packet[n++] = count;
+	for (uint8_t i = 0; i < count; i++){
+		packet[n++] = values[i];
+		packet[n++] = values[i] >> 8;
+	}
+
+	uint16_t crc = 0;
+	for (uint8_t i = 0; i < n; i++){
+		crc = _crc_xmodem_update(crc, packet[i]);
+	}
+	packet[n++] = crc;
+	packet[n++] = crc >> 8;
+
+	uint8_t frame[sizeof(packet) + 3];
+	uint8_t len = cobs_encode(packet, n, frame);
+	frame[len++] = 0x00; // End of packet
+	uart_write_blocking(frame, len);
+}
+#endif
+
+#endif /* TELEMETRY_H */
@@ -0,0 +1,119 @@
+/*
+ * telemetry_decoder.cpp
+ *
+ * Decodes the binary telemetry of 6a_Inputs/Aufgabe_02 and 6b_Outputs/Aufgabe_04
+ * (TELEMETRY_BINARY 1) and writes one CSV line per value.
+ *
+ * Build: g++ -std=c++17 -O2 -o telemetry_decoder telemetry_decoder.cpp
+ * Usage: stty -F /dev/ttyUSB0 500000 raw -echo
+ *        ./telemetry_decoder < /dev/ttyUSB0 > samples.csv
+ *
+ * Packet layout and channel IDs: see ../Telemetry/telemetry.h, which the firmware uses as well.
+ * Every packet is COBS encoded and ends with 0x00.
+ */
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include "../Telemetry/telemetry.h"
+
+// Time of one free running ADC conversion on the ATmega328P (13 ADC clocks at 125 kHz)
+constexpr double ADC_SAMPLE_US = 104.0;
+
+struct Stats {
+	unsigned long packets = 0;
+	unsigned long cobs_errors = 0;
+	unsigned long crc_errors = 0;
+	unsigned long lost_packets = 0;
+};
+
+// Reverses the COBS encoding, returns false if the frame is malformed
+static bool cobs_decode(const std::vector<uint8_t>& in, std::vector<uint8_t>& out) {
+	out.clear();
+	size_t i = 0;
+	while (i < in.size()) {
+		uint8_t code = in[i++];
+		if (code == 0) return false;
+		for (uint8_t k = 1; k < code; k++) {
+			if (i >= in.size()) return false;
+			out.push_back(in[i++]);
+		}
+		// A block shorter than 0xFF stands for a 0x00, except at the end of the frame
+		if (code != 0xFF && i < in.size()) out.push_back(0);
+	}
+	return true;
+}
+
+static uint16_t crc_xmodem(const uint8_t* data, size_t len) {
+	uint16_t crc = 0;
+	for (size_t i = 0; i < len; i++) {
+		crc ^= static_cast<uint16_t>(data[i]) << 8;
+		for (int bit = 0; bit < 8; bit++) {
+			crc = (crc & 0x8000) ? static_cast<uint16_t>((crc << 1) ^ 0x1021) : static_cast<uint16_t>(crc << 1);
+		}
+	}
+	return crc;
+}
+
+static uint32_t read_u32(const uint8_t* p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+static void handle_packet(const std::vector<uint8_t>& p, Stats& stats, int& last_seq) {
+	const size_t header = TELEMETRY_HEADER_SIZE;
+	if (p.size() < header + 2 || p.size() != header + 2 * static_cast<size_t>(p[header - 1]) + 2) {
+		stats.cobs_errors++;
+		return;
+	}
+	uint16_t crc = p[p.size() - 2] | (p[p.size() - 1] << 8);
+	if (crc != crc_xmodem(p.data(), p.size() - 2)) {
+		stats.crc_errors++;
+		return;
+	}
+
+	uint8_t seq = p[0];
+	if (last_seq >= 0) stats.lost_packets += static_cast<uint8_t>(seq - last_seq - 1);
+	last_seq = seq;
+	stats.packets++;
+
+	uint8_t channel = p[1];
+	uint32_t timestamp = read_u32(&p[2]);
+	uint8_t count = p[header - 1];
+	for (uint8_t i = 0; i < count; i++) {
+		uint16_t value = p[header + 2 * i] | (p[header + 2 * i + 1] << 8);
+		// Poti packets hold consecutive conversions, other channels a set of values taken at once
+		uint32_t sample = channel == TELEMETRY_CHANNEL_POTI ? timestamp + i : timestamp;
+		std::printf("%.0f,%u,%u,%u\n", sample * ADC_SAMPLE_US, channel, i, value);
+	}
+}
+
+int main() {
+	std::printf("time_us,channel,index,value\n");
+
+	Stats stats;
+	int last_seq = -1;
+	bool synced = false; // Everything before the first 0x00 may be the tail of a packet
+	std::vector<uint8_t> frame, packet;
+
+	int c;
+	while ((c = std::getchar()) != EOF) {
+		if (c != 0) {
+			if (synced) frame.push_back(static_cast<uint8_t>(c));
+			continue;
+		}
+		if (synced && !frame.empty()) {
+			if (cobs_decode(frame, packet)) {
+				handle_packet(packet, stats, last_seq);
+			} else {
+				stats.cobs_errors++;
+			}
+		}
+		frame.clear();
+		synced = true;
+	}
+
+	std::fprintf(stderr, "packets: %lu, lost: %lu, CRC errors: %lu, framing errors: %lu\n",
+		stats.packets, stats.lost_packets, stats.crc_errors, stats.cobs_errors);
+	return 0;
+}
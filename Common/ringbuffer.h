@@ -0,0 +1,102 @@
+/*
+ * ringbuffer.h
+ *
+ * Single producer / single consumer ring buffer, shared by the UART and ADC projects
+ * Include it once in main.c, e.g. #include "../../../Common/ringbuffer.h"
+ *
+ * head is only written by the producer and tail only by the consumer, so an interrupt and the
+ * main loop can share a buffer without disabling interrupts. Both indices run freely and are
+ * masked on access, head - tail is the number of bytes in the buffer.
+ */
+
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#include <stdint.h>
+
+typedef struct {
+	volatile uint8_t *buffer;
+	uint8_t mask;          // Size - 1, the size must be a power of two (max. 128)
+	volatile uint8_t head; // Next write position, only changed by the producer
+	volatile uint8_t tail; // Next read position, only changed by the consumer
+} RingBuffer;
+
+// Defines a ring buffer 'name' with its storage
+#define RINGBUFFER(name, size) \
+	_Static_assert(((size) & ((size) - 1)) == 0 && (size) <= 128, #name ": size must be a power of two <= 128"); \
+	volatile uint8_t name##_storage[size]; \
+	RingBuffer name = { name##_storage, (size) - 1, 0, 0 }
+
+// Reset to an empty buffer (only while neither side is using it)
+static inline void ringBufferInit(RingBuffer *rb) {
+	rb->head = rb->tail = 0;
+}
+
+// Number of bytes in the buffer
+static inline uint8_t ringBufferCount(RingBuffer *rb) {
+	return rb->head - rb->tail;
+}
+
+// Number of free bytes in the buffer
+static inline uint8_t ringBufferFree(RingBuffer *rb) {
+	return rb->mask + 1 - ringBufferCount(rb);
+}
+
+// Producer: write one byte, returns 0 if the buffer is full
+static inline uint8_t ringBufferWrite(RingBuffer *rb, uint8_t data) {
+	uint8_t head = rb->head;
+	if ((uint8_t)(head - rb->tail) > rb->mask) return 0;
+	rb->buffer[head & rb->mask] = data;
+	rb->head = head + 1; // Publish after the data is in the buffer
+	return 1;
+}
+
+// Consumer: read one byte, returns 0 if the buffer is empty
+static inline uint8_t ringBufferRead(RingBuffer *rb) {
+	uint8_t tail = rb->tail;
+	if (rb->head == tail) return 0;
+	uint8_t data = rb->buffer[tail & rb->mask];
+	rb->tail = tail + 1; // Release the slot after the data has been read
+	return data;
+}
+
+// Producer: write up to 'len' bytes, returns the number of bytes written
+static inline uint8_t ringBufferWriteN(RingBuffer *rb, const uint8_t *data, uint8_t len) {
+	uint8_t head = rb->head;
+	uint8_t space = rb->mask + 1 - (uint8_t)(head - rb->tail);
+	if (len > space) len = space;
+	for (uint8_t i = 0; i < len; i++) {
+		rb->buffer[head++ & rb->mask] = data[i];
+	}
+	rb->head = head;
+	return len;
+}
+
+// Consumer: read up to 'len' bytes, returns the number of bytes read
+static inline uint8_t ringBufferReadN(RingBuffer *rb, uint8_t *data, uint8_t len) {
+	uint8_t tail = rb->tail;
+	uint8_t count = rb->head - tail;
+	if (len > count) len = count;
+	for (uint8_t i = 0; i < len; i++) {
+		data[i] = rb->buffer[tail++ & rb->mask];
+	}
+	rb->tail = tail;
+	return len;
+}
+
+// Consumer: pointer to the oldest bytes without removing them
+// Returns how many bytes can be read there in one piece (up to the end of the storage)
+static inline uint8_t ringBufferPeek(RingBuffer *rb, volatile uint8_t **data) {
+	uint8_t tail = rb->tail;
+	uint8_t count = rb->head - tail;
+	uint8_t to_end = rb->mask + 1 - (tail & rb->mask);
+	*data = &rb->buffer[tail & rb->mask];
+	return count < to_end ? count : to_end;
+}
+
+// Consumer: remove the oldest 'len' bytes, e.g. after they have been used through ringBufferPeek()
+static inline void ringBufferCommit(RingBuffer *rb, uint8_t len) {
+	rb->tail += len;
+}
+
+#endif /* RINGBUFFER_H */